@@ -11,7 +11,7 @@ StackOffset AbstractSyntaxTree::stackOffset;
 std::map<std::string, StackOffset> AbstractSyntaxTree::stringLiteralLocations;
 
 #define MAKE_PAGE_ALLOCATOR(classname) \
-	static PageAllocator<sizeof(classname)> classname##allocator; \
+	static PageAllocator<sizeof(classname),0> classname##allocator; \
 	void* classname::operator new(size_t size) { assert(size == sizeof(classname)); return classname##allocator.allocate(); } \
 	void classname::operator delete(void* ptr) { classname##allocator.deallocate(ptr); }
 
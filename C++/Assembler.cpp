@@ -251,6 +251,96 @@ void Assembler::sar(IntRegister reg1, IntRegister reg2)
 	buffer.push8(0xF8);
 }
 
+void Assembler::add(IntRegister reg, ImmediateValue32 value, bool add64Bits)
+{
+	const uint8_t addImmediateValueOpcode2 = 0xC0;
+	rexPrefixIfNeeded(add64Bits, false, false, needsRexPrefix(reg));
+	if (static_cast<int32_t>(value.value) >= -128 && static_cast<int32_t>(value.value) <= 127) {
+		const uint8_t addSmallImmediateValueOpcode1 = 0x83;
+		buffer.push8(addSmallImmediateValueOpcode1);
+		buffer.push8(addImmediateValueOpcode2 + (reg % 8));
+		buffer.push8(static_cast<uint8_t>(value));
+	} else {
+		const uint8_t addLargeImmediateValueOpcode1 = 0x81;
+		buffer.push8(addLargeImmediateValueOpcode1);
+		buffer.push8(addImmediateValueOpcode2 + (reg % 8));
+		buffer.push32(value);
+	}
+}
+
+void Assembler::sub(IntRegister reg, ImmediateValue32 value, bool subtract64Bits)
+{
+	const uint8_t subtractImmediateValueOpcode2 = 0xE8;
+	rexPrefixIfNeeded(subtract64Bits, false, false, needsRexPrefix(reg));
+	if (static_cast<int32_t>(value.value) >= -128 && static_cast<int32_t>(value.value) <= 127) {
+		const uint8_t subtractSmallImmediateValueOpcode1 = 0x83;
+		buffer.push8(subtractSmallImmediateValueOpcode1);
+		buffer.push8(subtractImmediateValueOpcode2 + (reg % 8));
+		buffer.push8(static_cast<uint8_t>(value));
+	} else {
+		const uint8_t subtractLargeImmediateValueOpcode1 = 0x81;
+		buffer.push8(subtractLargeImmediateValueOpcode1);
+		buffer.push8(subtractImmediateValueOpcode2 + (reg % 8));
+		buffer.push32(value);
+	}
+}
+
+void Assembler::add(IntRegister destination, IntRegister source, int32_t offset)
+{
+	const uint8_t addMemoryOpcode = 0x03;
+	rexPrefixIfNeeded(false, needsRexPrefix(destination), false, needsRexPrefix(source));
+	buffer.push8(addMemoryOpcode);
+	memoryOperand(destination % 8, source, offset);
+}
+
+void Assembler::ror(IntRegister reg, uint8_t bits)
+{
+	const uint8_t rotateOpcode1 = 0xC1;
+	const uint8_t rotateRightOpcode2 = 0xC8;
+	rexPrefixIfNeeded(false, false, false, needsRexPrefix(reg));
+	buffer.push8(rotateOpcode1);
+	buffer.push8(rotateRightOpcode2 + (reg % 8));
+	buffer.push8(bits);
+}
+
+void Assembler::shr(IntRegister reg, uint8_t bits)
+{
+	const uint8_t shiftOpcode1 = 0xC1;
+	const uint8_t shiftRightOpcode2 = 0xE8;
+	rexPrefixIfNeeded(false, false, false, needsRexPrefix(reg));
+	buffer.push8(shiftOpcode1);
+	buffer.push8(shiftRightOpcode2 + (reg % 8));
+	buffer.push8(bits);
+}
+
+void Assembler::bswap(IntRegister reg)
+{
+	// 0x0F 0xC8 swaps eax, 0x0F 0xC9 swaps ecx, ... 0x0F 0xCF swaps edi
+	const uint8_t bswapOpcode1 = 0x0F;
+	const uint8_t bswapOpcode2 = 0xC8;
+	rexPrefixIfNeeded(false, false, false, needsRexPrefix(reg));
+	buffer.push8(bswapOpcode1);
+	buffer.push8(bswapOpcode2 + (reg % 8));
+}
+
+void Assembler::rorx(IntRegister destination, IntRegister source, uint8_t bits)
+{
+	// BMI2 instructions have a three byte VEX prefix instead of a rex prefix.
+	// The register extension bits are inverted, and the unused vvvv register field is all ones.
+	// http://wiki.osdev.org/X86-64_Instruction_Encoding#VEX.2FXOP_opcodes
+	const uint8_t vexPrefix = 0xC4;
+	const uint8_t vexMap0F3A = 0x03;
+	const uint8_t vexNoOperandF2 = 0x7B;
+	const uint8_t rorxOpcode = 0xF0;
+	const uint8_t registerToRegisterCode = 0xC0;
+	buffer.push8(vexPrefix);
+	buffer.push8((!needsRexPrefix(destination) << 7) | (1 << 6) | (!needsRexPrefix(source) << 5) | vexMap0F3A);
+	buffer.push8(vexNoOperandF2);
+	buffer.push8(rorxOpcode);
+	buffer.push8(registerToRegisterCode | ((destination % 8) << 3) | (source % 8));
+	buffer.push8(bits);
+}
+
 void Assembler::idiv(IntRegister reg)
 {
 	const uint8_t idivOpcode1 = 0xF7;
@@ -414,6 +504,117 @@ void Assembler::movsd(IntRegister destination, int32_t offset, DoubleRegister so
 	}
 }
 
+
+void Assembler::movdqu(DoubleRegister destination, IntRegister source, int32_t offset)
+{
+	const uint8_t movdquOpcode1 = 0xF3;
+	const uint8_t movdquOpcode2 = 0x0F;
+	const uint8_t movdquLoadOpcode3 = 0x6F;
+	buffer.push8(movdquOpcode1);
+	rexPrefixIfNeeded(false, needsRexPrefix(destination), false, needsRexPrefix(source));
+	buffer.push8(movdquOpcode2);
+	buffer.push8(movdquLoadOpcode3);
+	memoryOperand(destination % 8, source, offset);
+}
+
+void Assembler::movdqu(IntRegister destination, int32_t offset, DoubleRegister source)
+{
+	const uint8_t movdquOpcode1 = 0xF3;
+	const uint8_t movdquOpcode2 = 0x0F;
+	const uint8_t movdquStoreOpcode3 = 0x7F;
+	buffer.push8(movdquOpcode1);
+	rexPrefixIfNeeded(false, needsRexPrefix(source), false, needsRexPrefix(destination));
+	buffer.push8(movdquOpcode2);
+	buffer.push8(movdquStoreOpcode3);
+	memoryOperand(source % 8, destination, offset);
+}
+
+void Assembler::movdqa(DoubleRegister to, DoubleRegister from)
+{
+	const uint8_t opcodes[] = { 0x0F, 0x6F };
+	packedOperation(0x66, opcodes, sizeof(opcodes), to, from);
+}
+
+void Assembler::movq(DoubleRegister destination, IntRegister source)
+{
+	const uint8_t movqOpcode1 = 0x66;
+	const uint8_t movqOpcode2 = 0x0F;
+	const uint8_t movqOpcode3 = 0x6E;
+	const uint8_t movqOpcode4 = 0xC0;
+	buffer.push8(movqOpcode1);
+	rexPrefixIfNeeded(true, needsRexPrefix(destination), false, needsRexPrefix(source));
+	buffer.push8(movqOpcode2);
+	buffer.push8(movqOpcode3);
+	buffer.push8(movqOpcode4 + ((destination % 8) << 3) + (source % 8));
+}
+
+void Assembler::pinsrq(DoubleRegister destination, IntRegister source, uint8_t index)
+{
+	const uint8_t pinsrqOpcode1 = 0x66;
+	const uint8_t pinsrqOpcode2 = 0x0F;
+	const uint8_t pinsrqOpcode3 = 0x3A;
+	const uint8_t pinsrqOpcode4 = 0x22;
+	const uint8_t pinsrqOpcode5 = 0xC0;
+	buffer.push8(pinsrqOpcode1);
+	rexPrefixIfNeeded(true, needsRexPrefix(destination), false, needsRexPrefix(source));
+	buffer.push8(pinsrqOpcode2);
+	buffer.push8(pinsrqOpcode3);
+	buffer.push8(pinsrqOpcode4);
+	buffer.push8(pinsrqOpcode5 + ((destination % 8) << 3) + (source % 8));
+	buffer.push8(index);
+}
+
+void Assembler::paddd(DoubleRegister reg1, DoubleRegister reg2)
+{
+	const uint8_t opcodes[] = { 0x0F, 0xFE };
+	packedOperation(0x66, opcodes, sizeof(opcodes), reg1, reg2);
+}
+
+void Assembler::pshufb(DoubleRegister reg1, DoubleRegister reg2)
+{
+	const uint8_t opcodes[] = { 0x0F, 0x38, 0x00 };
+	packedOperation(0x66, opcodes, sizeof(opcodes), reg1, reg2);
+}
+
+void Assembler::pshufd(DoubleRegister reg1, DoubleRegister reg2, uint8_t order)
+{
+	const uint8_t opcodes[] = { 0x0F, 0x70 };
+	packedOperation(0x66, opcodes, sizeof(opcodes), reg1, reg2);
+	buffer.push8(order);
+}
+
+void Assembler::palignr(DoubleRegister reg1, DoubleRegister reg2, uint8_t bytes)
+{
+	const uint8_t opcodes[] = { 0x0F, 0x3A, 0x0F };
+	packedOperation(0x66, opcodes, sizeof(opcodes), reg1, reg2);
+	buffer.push8(bytes);
+}
+
+void Assembler::pblendw(DoubleRegister reg1, DoubleRegister reg2, uint8_t mask)
+{
+	const uint8_t opcodes[] = { 0x0F, 0x3A, 0x0E };
+	packedOperation(0x66, opcodes, sizeof(opcodes), reg1, reg2);
+	buffer.push8(mask);
+}
+
+void Assembler::sha256rnds2(DoubleRegister cdgh, DoubleRegister abef)
+{
+	const uint8_t opcodes[] = { 0x0F, 0x38, 0xCB };
+	packedOperation(0, opcodes, sizeof(opcodes), cdgh, abef);
+}
+
+void Assembler::sha256msg1(DoubleRegister reg1, DoubleRegister reg2)
+{
+	const uint8_t opcodes[] = { 0x0F, 0x38, 0xCC };
+	packedOperation(0, opcodes, sizeof(opcodes), reg1, reg2);
+}
+
+void Assembler::sha256msg2(DoubleRegister reg1, DoubleRegister reg2)
+{
+	const uint8_t opcodes[] = { 0x0F, 0x38, 0xCD };
+	packedOperation(0, opcodes, sizeof(opcodes), reg1, reg2);
+}
+
 #else
 
 uint32_t Assembler::fldOperationSize(IntRegister source, int32_t offset)
@@ -754,6 +955,44 @@ void Assembler::cvttsd2si(IntRegister reg1, DoubleRegister reg2)
 }
 #endif
 
+// Memory operands at an offset from a base register share their encoding between instructions.
+void Assembler::memoryOperand(uint8_t reg, IntRegister base, int32_t offset)
+{
+	const uint8_t espSuffix = 0x24;
+	if (!offset && (base % 8) != ebp) { // ebp and r13 have no 0-offset opcode
+		const uint8_t noOffsetCode = 0x00;
+		buffer.push8(noOffsetCode + (reg << 3) + (base % 8));
+		if ((base % 8) == esp)
+			buffer.push8(espSuffix);
+	} else if (-128 <= offset && offset <= 127) {
+		const uint8_t smallOffsetCode = 0x40;
+		buffer.push8(smallOffsetCode + (reg << 3) + (base % 8));
+		if ((base % 8) == esp)
+			buffer.push8(espSuffix);
+		buffer.push8(static_cast<uint8_t>(offset));
+	} else {
+		const uint8_t largeOffsetCode = 0x80;
+		buffer.push8(largeOffsetCode + (reg << 3) + (base % 8));
+		if ((base % 8) == esp)
+			buffer.push8(espSuffix);
+		buffer.push32(offset);
+	}
+}
+
+#ifdef _M_X64
+// SSE operations between two registers are an optional prefix, a rex prefix if needed, the opcodes and the registers.
+void Assembler::packedOperation(uint8_t prefix, const uint8_t* opcodes, uint32_t opcodeCount, DoubleRegister reg1, DoubleRegister reg2)
+{
+	const uint8_t registerToRegisterCode = 0xC0;
+	if (prefix)
+		buffer.push8(prefix);
+	rexPrefixIfNeeded(false, needsRexPrefix(reg1), false, needsRexPrefix(reg2));
+	for (uint32_t i = 0; i < opcodeCount; ++i)
+		buffer.push8(opcodes[i]);
+	buffer.push8(registerToRegisterCode + ((reg1 % 8) << 3) + (reg2 % 8));
+}
+#endif
+
 // x86 doesn't use 64-bit operands or extended registers
 // x86_64 requires a prefix byte indicating the use of a 64-bit operand or the use of r8 - r15
 // http://wiki.osdev.org/X86-64_Instruction_Encoding#REX_prefix
@@ -71,6 +71,13 @@ public:
 	void xor(IntRegister, IntRegister); // 32-bit bitwise xor
 	void shl(IntRegister, IntRegister); // 32-bit signed shift left
 	void sar(IntRegister, IntRegister); // 32-bit unsigned shift right
+	void add(IntRegister, ImmediateValue32, bool add64Bits); // addition of a constant to any register
+	void sub(IntRegister, ImmediateValue32, bool subtract64Bits); // subtraction of a constant from any register
+	void add(IntRegister destination, IntRegister source, int32_t offset); // 32-bit addition of a value in memory
+	void ror(IntRegister, uint8_t bits); // 32-bit rotate right
+	void shr(IntRegister, uint8_t bits); // 32-bit unsigned shift right
+	void bswap(IntRegister); // 32-bit byte order reversal
+	void rorx(IntRegister destination, IntRegister source, uint8_t bits); // 32-bit rotate right into another register without changing flags (BMI2)
 
 	// control flow
 	void cmp(IntRegister, IntRegister);
@@ -95,6 +102,21 @@ public:
 	static uint32_t comisdOperationSize();
 	void movsd(DoubleRegister destination, IntRegister source, int32_t offset);
 	void movsd(IntRegister destination, int32_t offset, DoubleRegister source);
+
+	// packed integer operations
+	void movdqu(DoubleRegister destination, IntRegister source, int32_t offset); // Move Unaligned Double Quadword
+	void movdqu(IntRegister destination, int32_t offset, DoubleRegister source);
+	void movdqa(DoubleRegister to, DoubleRegister from); // Move Aligned Double Quadword
+	void movq(DoubleRegister, IntRegister); // Move Quadword into the low half and clear the high half
+	void pinsrq(DoubleRegister, IntRegister, uint8_t index); // Insert Quadword (SSE4.1)
+	void paddd(DoubleRegister, DoubleRegister); // Add Packed Doubleword Integers
+	void pshufb(DoubleRegister, DoubleRegister); // Packed Shuffle Bytes (SSSE3)
+	void pshufd(DoubleRegister, DoubleRegister, uint8_t order); // Shuffle Packed Doublewords
+	void palignr(DoubleRegister, DoubleRegister, uint8_t bytes); // Packed Align Right (SSSE3)
+	void pblendw(DoubleRegister, DoubleRegister, uint8_t mask); // Blend Packed Words (SSE4.1)
+	void sha256rnds2(DoubleRegister cdgh, DoubleRegister abef); // Two SHA-256 rounds with the message and constants in xmm0
+	void sha256msg1(DoubleRegister, DoubleRegister); // SHA-256 message schedule, first part
+	void sha256msg2(DoubleRegister, DoubleRegister); // SHA-256 message schedule, second part
 #else
 	void cvttsd2si(IntRegister destination, IntRegister source, int32_t offset);
 	static uint32_t fldOperationSize(IntRegister source, int32_t offset);
@@ -117,8 +139,10 @@ private:
 	AssemblerBuffer& buffer;
 	void rexPrefixIfNeeded(bool, bool, bool, bool);
 	bool needsRexPrefix(IntRegister);
+	void memoryOperand(uint8_t reg, IntRegister base, int32_t offset);
 #ifdef _M_X64
 	bool needsRexPrefix(DoubleRegister);
+	void packedOperation(uint8_t prefix, const uint8_t* opcodes, uint32_t opcodeCount, DoubleRegister, DoubleRegister);
 #endif
 };
 
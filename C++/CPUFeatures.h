@@ -0,0 +1,121 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include <stdint.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SHA2_X86 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#endif
+
+// MSVC lets any function use any intrinsic, but GCC and Clang need each function
+// that uses instructions beyond the compilation target to be marked with them.
+#if defined(SHA2_X86) && !defined(_MSC_VER)
+#define SHA2_TARGET(extensions) __attribute__((target(extensions)))
+#else
+#define SHA2_TARGET(extensions)
+#endif
+
+namespace SHA2 {
+
+// Instruction set extensions that the hashing kernels can use, checked once with cpuid.
+// The operating system must also save the vector registers across context switches,
+// which xgetbv reports, before the AVX extensions are usable.
+struct CPUFeatures {
+    bool avx2 { false };
+    bool avx512 { false }; // AVX-512 F and VL
+    bool bmi2 { false };
+    bool sha { false };
+
+    // This is mutable so tests can turn off extensions to check the portable paths.
+    static CPUFeatures& host()
+    {
+        static CPUFeatures features = detect();
+        return features;
+    }
+
+private:
+    static CPUFeatures detect()
+    {
+        CPUFeatures features;
+#ifdef SHA2_X86
+        uint32_t registers[4];
+        cpuid(0, registers);
+        if (registers[0] < 7)
+            return features;
+
+        cpuid(1, registers);
+        const bool osxsave = registers[2] & (1 << 27);
+        const bool avx = registers[2] & (1 << 28);
+        const bool sse41 = registers[2] & (1 << 19);
+        const bool ssse3 = registers[2] & (1 << 9);
+        const uint64_t enabledState = osxsave ? xgetbv() : 0;
+        const bool ymmEnabled = (enabledState & 0x06) == 0x06;
+        const bool zmmEnabled = (enabledState & 0xe6) == 0xe6;
+
+        cpuid(7, registers);
+        features.avx2 = avx && ymmEnabled && (registers[1] & (1 << 5));
+        features.avx512 = features.avx2 && zmmEnabled && (registers[1] & (1 << 16)) && (registers[1] & (1u << 31));
+        features.bmi2 = registers[1] & (1 << 8);
+        features.sha = sse41 && ssse3 && (registers[1] & (1 << 29));
+#endif
+        return features;
+    }
+
+#ifdef SHA2_X86
+    static void cpuid(uint32_t leaf, uint32_t (&registers)[4])
+    {
+#ifdef _MSC_VER
+        __cpuidex(reinterpret_cast<int*>(registers), leaf, 0);
+#else
+        __cpuid_count(leaf, 0, registers[0], registers[1], registers[2], registers[3]);
+#endif
+    }
+
+    static uint64_t xgetbv()
+    {
+#ifdef _MSC_VER
+        return _xgetbv(0);
+#else
+        uint32_t eax, edx;
+        __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+    }
+#endif
+};
+
+}
@@ -1,4 +1,17 @@
 #include "AbstractSyntaxTree.h"
+#include "CPUFeatures.h"
+#include "SHA256Generator.h"
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// ThreadSafePageAllocator needs thread_local, which Visual Studio 2013 does not have
+#if !defined(_MSC_VER) || _MSC_VER >= 1900
+#define TEST_THREAD_SAFE_PAGE_ALLOCATOR
+#include "ThreadSafePageAllocator.h"
+#endif
 
 #ifdef NDEBUG
 #undef assert
@@ -133,8 +146,239 @@ static void clearX87Stack()
 }
 #endif
 
+// with no overhead, every element of a page is found by masking its address with the page alignment
+template <size_t ElementSize>
+static void testPageAllocatorLayout()
+{
+	typedef PageAllocator<ElementSize, 0> Allocator;
+	const size_t alignment = ElementSize & (0 - ElementSize); // the largest power of two dividing ElementSize
+	assert(Allocator::ElementsPerPage > 127 && Allocator::ElementsPerPage < 256);
+	assert(Allocator::ElementsPerPage * ElementSize + Allocator::PageTrailerSize <= Allocator::PageAlignment);
+
+	Allocator allocator;
+	std::vector<unsigned char*> elements(Allocator::ElementsPerPage);
+	for (int round = 0; round < 3; round++) {
+		for (size_t i = 0; i < elements.size(); i++) {
+			elements[i] = static_cast<unsigned char*>(allocator.allocate());
+			const size_t address = reinterpret_cast<size_t>(elements[i]);
+			const size_t offset = address & (Allocator::PageAlignment - 1);
+			assert(address % alignment == 0);
+			assert(offset % ElementSize == 0 && offset / ElementSize < Allocator::ElementsPerPage);
+			// the whole page is one aligned block, so masking any element finds the same page
+			assert((address & ~(Allocator::PageAlignment - 1)) == (reinterpret_cast<size_t>(elements[0]) & ~(Allocator::PageAlignment - 1)));
+			elements[i][0] = static_cast<unsigned char>(i);
+			elements[i][ElementSize - 1] = static_cast<unsigned char>(i);
+		}
+		// each slot of the page was handed out once
+		std::vector<unsigned char*> sorted(elements);
+		std::sort(sorted.begin(), sorted.end());
+		assert(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end());
+		assert(allocator.allocatedCount() == Allocator::ElementsPerPage);
+		assert(allocator.pageCount() == 2); // the full page and the empty page that replaced it
+		for (size_t i = 0; i < elements.size(); i++) {
+			assert(elements[i][0] == static_cast<unsigned char>(i) && elements[i][ElementSize - 1] == static_cast<unsigned char>(i));
+			allocator.deallocate(elements[i]);
+		}
+		assert(allocator.allocatedCount() == 0);
+		assert(allocator.pageCount() == 1);
+	}
+}
+
+static void testPageAllocatorLayouts()
+{
+	testPageAllocatorLayout<1>();
+	testPageAllocatorLayout<16>();
+	testPageAllocatorLayout<24>();
+	testPageAllocatorLayout<5000>();
+}
+
+// one producer allocates and consumers deallocate, so every element goes back through its page's remote free list
+template <size_t OverheadSize>
+static void testPageAllocatorRemoteFrees()
+{
+	typedef PageAllocator<16, OverheadSize, true> Allocator;
+	const uint64_t Live = 0x4556494C4556494Cull;
+	const size_t Elements = 200000;
+	const size_t QueueLimit = 1000;
+	const size_t Consumers = 3;
+
+	Allocator allocator;
+	std::mutex mutex;
+	std::deque<uint64_t*> queue;
+	bool done = false;
+	std::vector<std::thread> consumers;
+	for (size_t i = 0; i < Consumers; i++) {
+		consumers.push_back(std::thread([&] {
+			for (;;) {
+				uint64_t* element = nullptr;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (!queue.empty()) {
+						element = queue.front();
+						queue.pop_front();
+					} else if (done)
+						return;
+				}
+				if (!element) {
+					std::this_thread::yield();
+					continue;
+				}
+				assert(element[1] == Live);
+				element[1] = 0;
+				allocator.deallocate(element);
+			}
+		}));
+	}
+
+	size_t maxPages = 0;
+	for (size_t i = 0; i < Elements; i++) {
+		uint64_t* element = static_cast<uint64_t*>(allocator.allocate());
+		assert(element[1] != Live); // an element is not handed out again before it is deallocated
+		element[1] = Live;
+		for (;;) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (queue.size() < QueueLimit) {
+					queue.push_back(element);
+					break;
+				}
+			}
+			std::this_thread::yield();
+		}
+		maxPages = std::max(maxPages, allocator.pageCount());
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		done = true;
+	}
+	for (size_t i = 0; i < Consumers; i++)
+		consumers[i].join();
+
+	// the elements the owner took back are reused, so the pages never outgrow the elements in flight
+	assert(maxPages <= 2 * (QueueLimit + Consumers) / Allocator::ElementsPerPage + 2);
+	allocator.deallocate(allocator.allocate()); // takes back the last remote frees
+	assert(allocator.allocatedCount() == 0);
+	assert(allocator.pageCount() == 1);
+}
+
+#ifdef TEST_THREAD_SAFE_PAGE_ALLOCATOR
+static void waitFor(const std::atomic<int>& stage, int value)
+{
+	while (stage.load() != value)
+		std::this_thread::yield();
+}
+
+static void testThreadSafePageAllocator()
+{
+	typedef ThreadSafePageAllocator<16> Allocator;
+	const size_t half = Allocator::MagazineSize / 2;
+
+	{ // magazine refills and give-backs, and draining a thread's magazine when it exits
+		Allocator allocator;
+		std::thread([&] {
+			std::vector<void*> elements;
+			elements.push_back(allocator.allocate());
+			assert(allocator.allocatedCount() == half); // the first allocation fills the magazine halfway
+			while (elements.size() < half)
+				elements.push_back(allocator.allocate());
+			assert(allocator.allocatedCount() == half);
+			elements.push_back(allocator.allocate());
+			assert(allocator.allocatedCount() == 2 * half); // an empty magazine is refilled
+			while (elements.size() < Allocator::MagazineSize + 1)
+				elements.push_back(allocator.allocate());
+			assert(allocator.allocatedCount() == 3 * half); // the magazine holds half - 1 elements now
+
+			for (size_t i = 0; i < half + 1; i++)
+				allocator.deallocate(elements[i]);
+			assert(allocator.allocatedCount() == 3 * half); // the magazine is full
+			allocator.deallocate(elements[half + 1]);
+			assert(allocator.allocatedCount() == 2 * half); // a full magazine gives back half
+			for (size_t i = half + 2; i < elements.size(); i++)
+				allocator.deallocate(elements[i]);
+			assert(allocator.allocatedCount() == 2 * half);
+		}).join();
+		assert(allocator.allocatedCount() == 0);
+	}
+
+	{ // allocating in one thread and deallocating in another
+		Allocator allocator;
+		std::vector<uint64_t*> elements(1000);
+		std::thread([&] {
+			for (size_t i = 0; i < elements.size(); i++) {
+				elements[i] = static_cast<uint64_t*>(allocator.allocate());
+				elements[i][0] = i;
+				elements[i][1] = ~i;
+			}
+		}).join();
+		const size_t pages = allocator.pageCount();
+		std::thread([&] {
+			for (size_t i = 0; i < elements.size(); i++) {
+				assert(elements[i][0] == i && elements[i][1] == ~i);
+				allocator.deallocate(elements[i]);
+			}
+		}).join();
+		assert(allocator.allocatedCount() == 0);
+		std::thread([&] {
+			for (size_t i = 0; i < elements.size(); i++)
+				elements[i] = static_cast<uint64_t*>(allocator.allocate());
+			assert(allocator.pageCount() <= pages);
+			for (size_t i = 0; i < elements.size(); i++)
+				allocator.deallocate(elements[i]);
+		}).join();
+	}
+
+	{ // destroying an allocator that a running thread has used
+		Allocator* temporary = new Allocator;
+		Allocator lasting;
+		std::atomic<int> stage(0);
+		std::thread thread([&] {
+			temporary->deallocate(temporary->allocate());
+			stage = 1;
+			// keep searching this thread's magazines, including the one being cleared, while the allocator is destroyed
+			while (stage.load() != 2)
+				lasting.deallocate(lasting.allocate());
+			// the magazine the destroyed allocator used is claimed again, and draining at exit skips it
+			Allocator replacement;
+			for (int i = 0; i < 1000; i++) {
+				lasting.deallocate(lasting.allocate());
+				replacement.deallocate(replacement.allocate());
+			}
+		});
+		waitFor(stage, 1);
+		delete temporary;
+		stage = 2;
+		thread.join();
+		assert(lasting.allocatedCount() == 0);
+	}
+
+	{ // allocators beyond the magazines a thread has take the lock every time
+		Allocator allocators[Allocator::MaxAllocatorsPerThread + 2];
+		std::thread([&] {
+			void* elements[Allocator::MaxAllocatorsPerThread + 2];
+			for (size_t i = 0; i < Allocator::MaxAllocatorsPerThread + 2; i++)
+				elements[i] = allocators[i].allocate();
+			for (size_t i = 0; i < Allocator::MaxAllocatorsPerThread + 2; i++)
+				assert(allocators[i].allocatedCount() == (i < Allocator::MaxAllocatorsPerThread ? half : 1));
+			for (size_t i = 0; i < Allocator::MaxAllocatorsPerThread + 2; i++)
+				allocators[i].deallocate(elements[i]);
+			for (size_t i = 0; i < Allocator::MaxAllocatorsPerThread + 2; i++)
+				assert(allocators[i].allocatedCount() == (i < Allocator::MaxAllocatorsPerThread ? half : 0));
+		}).join();
+		for (size_t i = 0; i < Allocator::MaxAllocatorsPerThread + 2; i++)
+			assert(allocators[i].allocatedCount() == 0);
+	}
+}
+#endif
+
 void AbstractSyntaxTree::runASTUnitTests()
 {
+	testPageAllocatorLayouts();
+	testPageAllocatorRemoteFrees<4>();
+	testPageAllocatorRemoteFrees<0>();
+#ifdef TEST_THREAD_SAFE_PAGE_ALLOCATOR
+	testThreadSafePageAllocator();
+#endif
+
 	AssemblerBuffer buffer;
 	{ // return values
 		// return 7;
@@ -2206,6 +2450,65 @@ void AbstractSyntaxTree::runASTUnitTests()
 #endif
 }
 
+#ifdef _M_X64
+// Compresses a message of at most 55 bytes, which fits in one padded block, or at most 119 bytes, which fits in two.
+static void compressShortMessage(SHA256Generator::CompressFunction compress, const char* message, uint32_t (&state)[8])
+{
+	static const uint32_t initialHash[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	uint8_t blocks[128] = { };
+	const size_t length = strlen(message);
+	const size_t blockCount = length < 56 ? 1 : 2;
+	memcpy(blocks, message, length);
+	blocks[length] = 0x80;
+	for (size_t i = 0; i < 8; ++i)
+		blocks[blockCount * 64 - 1 - i] = static_cast<uint8_t>((length * 8) >> (8 * i));
+	memcpy(state, initialHash, sizeof(state));
+	compress(state, blocks, blockCount);
+}
+
+void SHA256Generator::runSHA256GeneratorUnitTests()
+{
+	static const uint32_t abcDigest[8] = { 0xba7816bf, 0x8f01cfea, 0x414140de, 0x5dae2223, 0xb00361a3, 0x96177a9c, 0xb410ff61, 0xf20015ad };
+	static const uint32_t twoBlockDigest[8] = { 0x248d6a61, 0xd20638b8, 0xe5c02693, 0x0c3e6039, 0xa33ce459, 0x64ff2167, 0xf6ecedd4, 0x19db06c1 };
+
+	std::vector<uint8_t> data(100 * 64);
+	for (size_t i = 0; i < data.size(); ++i)
+		data[i] = static_cast<uint8_t>(i * 7 + (i >> 8));
+	uint32_t expected[8] = { };
+
+	const SHA2::CPUFeatures& features = SHA2::CPUFeatures::host();
+	const Kernel kernels[] = { Scalar, ScalarBMI2, SHAExtensions };
+	for (Kernel kernel : kernels) {
+		if ((kernel == ScalarBMI2 && !features.bmi2) || (kernel == SHAExtensions && !features.sha))
+			continue;
+		SHA256Generator generator(kernel);
+		CompressFunction compress = generator.compressFunction();
+
+		uint32_t state[8];
+		compressShortMessage(compress, "abc", state);
+		assert(!memcmp(state, abcDigest, sizeof(state)));
+		compressShortMessage(compress, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", state);
+		assert(!memcmp(state, twoBlockDigest, sizeof(state)));
+
+		// No blocks leave the state alone.
+		uint32_t unchanged[8];
+		memcpy(unchanged, state, sizeof(state));
+		compress(state, data.data(), 0);
+		assert(!memcmp(state, unchanged, sizeof(state)));
+
+		// Every kernel agrees with the first on many blocks, whether they are compressed together or one at a time.
+		compress(state, data.data(), data.size() / 64);
+		if (kernel == Scalar)
+			memcpy(expected, state, sizeof(state));
+		assert(!memcmp(state, expected, sizeof(state)));
+		memcpy(state, unchanged, sizeof(state));
+		for (size_t i = 0; i < data.size() / 64; ++i)
+			compress(state, data.data() + i * 64, 1);
+		assert(!memcmp(state, expected, sizeof(state)));
+	}
+}
+#endif
+
 void Assembler::runAssemblerUnitTests()
 {
 	AssemblerBuffer buffer;
@@ -2529,6 +2832,95 @@ void Assembler::runAssemblerUnitTests()
 		double(*function)() = reinterpret_cast<double(*)()>(buffer.getExecutableAddress());
 		assert(function() == 1.7);
 	}
+	{ // add and subtract constants
+		buffer.clear();
+		assembler.mov(r9, ImmediateValue32(5));
+		assembler.add(r9, ImmediateValue32(1000), false);
+		assembler.sub(r9, ImmediateValue32(3), false);
+		assembler.add(r9, ImmediateValue32(-2), false);
+		assembler.mov(eax, r9);
+		assembler.ret();
+		uint32_t(*function)() = reinterpret_cast<uint32_t(*)()>(buffer.getExecutableAddress());
+		assert(function() == 1000);
+		buffer.clear();
+		assembler.mov(eax, ImmediateValue64(0xFFFFFFFFull));
+		assembler.add(eax, ImmediateValue32(1), true);
+		assembler.ret();
+		uint64_t(*function64)() = reinterpret_cast<uint64_t(*)()>(buffer.getExecutableAddress());
+		assert(function64() == 0x100000000ull);
+	}
+	{ // add values in memory
+		buffer.clear();
+		assembler.mov(ecx, ImmediateValue32(7));
+		assembler.mov(esp, -8, ecx, false);
+		assembler.mov(r11, esp);
+		assembler.mov(r10, ImmediateValue32(5));
+		assembler.add(r10, r11, -8);
+		assembler.add(r10, esp, -8);
+		assembler.mov(eax, r10);
+		assembler.ret();
+		uint32_t(*function)() = reinterpret_cast<uint32_t(*)()>(buffer.getExecutableAddress());
+		assert(function() == 19);
+	}
+	{ // rotate, shift and swap bytes
+		buffer.clear();
+		assembler.mov(eax, ImmediateValue32(0x12345678));
+		assembler.ror(eax, 8);
+		assembler.mov(r11, ImmediateValue32(0x80000000));
+		assembler.shr(r11, 4);
+		assembler.xor(eax, r11);
+		assembler.bswap(eax);
+		assembler.ret();
+		uint32_t(*function)() = reinterpret_cast<uint32_t(*)()>(buffer.getExecutableAddress());
+		assert(function() == 0x56341270);
+	}
+	if (SHA2::CPUFeatures::host().bmi2) { // rotate into another register
+		buffer.clear();
+		assembler.mov(r10, ImmediateValue32(0x12345678));
+		assembler.rorx(eax, r10, 4);
+		assembler.rorx(r8, eax, 28);
+		assembler.xor(eax, r8);
+		assembler.ret();
+		uint32_t(*function)() = reinterpret_cast<uint32_t(*)()>(buffer.getExecutableAddress());
+		assert(function() == (0x81234567 ^ 0x12345678));
+	}
+	{ // packed integer operations
+		buffer.clear();
+		assembler.mov(eax, ImmediateValue64(0x0000000200000001ull));
+		assembler.movq(xmm9, eax);
+		assembler.mov(eax, ImmediateValue64(0x0000000400000003ull));
+		assembler.pinsrq(xmm9, eax, 1);
+		assembler.movdqa(xmm1, xmm9);
+		assembler.pshufd(xmm1, xmm1, 0x1B); // 4 3 2 1
+		assembler.paddd(xmm1, xmm9); // 5 5 5 5
+		assembler.palignr(xmm1, xmm9, 4); // 2 3 4 5
+		assembler.pblendw(xmm1, xmm9, 0x03); // 1 3 4 5
+		assembler.movdqu(esp, -16, xmm1);
+		assembler.mov(r11, esp);
+		assembler.movdqu(xmm2, r11, -16);
+		assembler.movdqu(r11, -32, xmm2);
+		assembler.mov(eax, esp, -32, false);
+		assembler.add(eax, esp, -28);
+		assembler.add(eax, esp, -24);
+		assembler.mov(ecx, esp, -20, false);
+		assembler.imul(eax, ecx);
+		assembler.ret();
+		uint32_t(*function)() = reinterpret_cast<uint32_t(*)()>(buffer.getExecutableAddress());
+		assert(function() == (1 + 3 + 4) * 5);
+	}
+	{ // shuffle bytes
+		buffer.clear();
+		assembler.mov(eax, ImmediateValue64(0x0706050403020100ull));
+		assembler.movq(xmm3, eax);
+		assembler.mov(eax, ImmediateValue64(0x0405060700010203ull));
+		assembler.movq(xmm12, eax);
+		assembler.pshufb(xmm3, xmm12);
+		assembler.movdqu(esp, -16, xmm3);
+		assembler.mov(eax, esp, -16, false);
+		assembler.ret();
+		uint32_t(*function)() = reinterpret_cast<uint32_t(*)()>(buffer.getExecutableAddress());
+		assert(function() == 0x00010203);
+	}
 #else
 	{ // push 64 bit values
 		buffer.clear();
@@ -0,0 +1,433 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace SHA2 {
+
+// A read-only file that is mapped into memory one window at a time, so reading a large
+// file does not keep more than one window of it resident in this process.
+// The file is read front to back, and the kernel is told so it can read ahead.
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const char* path)
+    {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize)) {
+            close();
+            return false;
+        }
+        size = fileSize.QuadPart;
+        if (size) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!mapping) {
+                close();
+                return false;
+            }
+        }
+#else
+        file = ::open(path, O_RDONLY);
+        if (file < 0)
+            return false;
+        struct stat status;
+        if (fstat(file, &status) || !S_ISREG(status.st_mode)) {
+            close();
+            return false;
+        }
+        size = status.st_size;
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#endif
+        return true;
+    }
+
+    void close()
+    {
+        unmap();
+#ifdef _WIN32
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (file >= 0)
+            ::close(file);
+        file = -1;
+#endif
+        size = 0;
+    }
+
+    uint64_t fileSize() const { return size; }
+
+    // Offsets passed to map must be multiples of this.
+    static size_t granularity()
+    {
+        // A function-local static is initialized once even when threads call this at the same time.
+        static const size_t value = queryGranularity();
+        return value;
+    }
+
+    // Maps length bytes starting at offset in place of the previous window, or returns null.
+    const uint8_t* map(uint64_t offset, size_t length)
+    {
+        unmap();
+        if (!length || offset + length > size)
+            return nullptr;
+#ifdef _WIN32
+        view = MapViewOfFile(mapping, FILE_MAP_READ, static_cast<DWORD>(offset >> 32), static_cast<DWORD>(offset), length);
+        if (!view)
+            return nullptr;
+#else
+        view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file, offset);
+        if (view == MAP_FAILED) {
+            view = nullptr;
+            return nullptr;
+        }
+        madvise(view, length, MADV_SEQUENTIAL);
+#endif
+        viewSize = length;
+        return reinterpret_cast<const uint8_t*>(view);
+    }
+
+    // Asks the kernel to start reading a range that will be mapped soon.
+    void prefetch(uint64_t offset, size_t length)
+    {
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+        posix_fadvise(file, offset, length, POSIX_FADV_WILLNEED);
+#endif
+    }
+
+    void unmap()
+    {
+        if (!view)
+            return;
+#ifdef _WIN32
+        UnmapViewOfFile(view);
+#else
+        munmap(view, viewSize);
+#endif
+        view = nullptr;
+        viewSize = 0;
+    }
+
+private:
+    static size_t queryGranularity()
+    {
+#ifdef _WIN32
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        return si.dwAllocationGranularity;
+#else
+        return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    }
+
+#ifdef _WIN32
+    HANDLE file { INVALID_HANDLE_VALUE };
+    HANDLE mapping { nullptr };
+#else
+    int file { -1 };
+#endif
+    uint64_t size { 0 };
+    void* view { nullptr };
+    size_t viewSize { 0 };
+};
+
+
+// A whole file mapped for reading, or for reading and writing in place, shared with every other
+// mapping of the file, so stores made through one mapping are seen through all of them.
+class SharedMappedFile {
+public:
+    SharedMappedFile() = default;
+    ~SharedMappedFile() { close(); }
+    SharedMappedFile(const SharedMappedFile&) = delete;
+    SharedMappedFile& operator=(const SharedMappedFile&) = delete;
+
+    // Maps an existing file that is not empty.
+    bool open(const char* path, bool writable)
+    {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ | (writable ? GENERIC_WRITE : 0), FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize)) {
+            close();
+            return false;
+        }
+        return mapWhole(static_cast<uint64_t>(fileSize.QuadPart), writable);
+#else
+        file = ::open(path, writable ? O_RDWR : O_RDONLY);
+        struct stat status;
+        if (file < 0 || fstat(file, &status) || !S_ISREG(status.st_mode)) {
+            close();
+            return false;
+        }
+        return mapWhole(static_cast<uint64_t>(status.st_size), writable);
+#endif
+    }
+
+    // Creates the file, or empties an existing one, sizes it to fileSize zero bytes and maps it for writing.
+    bool create(const char* path, uint64_t fileSize)
+    {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER end;
+        end.QuadPart = static_cast<LONGLONG>(fileSize);
+        if (!SetFilePointerEx(file, end, nullptr, FILE_BEGIN) || !SetEndOfFile(file)) {
+            close();
+            return false;
+        }
+#else
+        file = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (file < 0 || ftruncate(file, static_cast<off_t>(fileSize))) {
+            close();
+            return false;
+        }
+#endif
+        return mapWhole(fileSize, true);
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (view)
+            UnmapViewOfFile(view);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (view)
+            munmap(view, static_cast<size_t>(size));
+        if (file >= 0)
+            ::close(file);
+        file = -1;
+#endif
+        view = nullptr;
+        size = 0;
+    }
+
+    uint8_t* data() const { return reinterpret_cast<uint8_t*>(view); }
+    uint64_t fileSize() const { return size; }
+
+    // Writes the mapped pages back to the file and waits for them to reach the disk.
+    bool flush() const
+    {
+#ifdef _WIN32
+        return view && FlushViewOfFile(view, 0) && FlushFileBuffers(file);
+#else
+        return view && !msync(view, static_cast<size_t>(size), MS_SYNC);
+#endif
+    }
+
+private:
+    bool mapWhole(uint64_t fileSize, bool writable)
+    {
+        if (!fileSize || fileSize > static_cast<size_t>(-1)) {
+            close();
+            return false;
+        }
+#ifdef _WIN32
+        mapping = CreateFileMappingA(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+        view = mapping ? MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0) : nullptr;
+#else
+        view = mmap(nullptr, static_cast<size_t>(fileSize), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, 0);
+        if (view == MAP_FAILED)
+            view = nullptr;
+#endif
+        if (!view) {
+            close();
+            return false;
+        }
+        size = fileSize;
+        return true;
+    }
+
+#ifdef _WIN32
+    HANDLE file { INVALID_HANDLE_VALUE };
+    HANDLE mapping { nullptr };
+#else
+    int file { -1 };
+#endif
+    uint64_t size { 0 };
+    void* view { nullptr };
+};
+
+// A file read and written at explicit offsets, which several threads may do at once.
+class RandomAccessFile {
+public:
+    RandomAccessFile() = default;
+    ~RandomAccessFile() { close(); }
+    RandomAccessFile(const RandomAccessFile&) = delete;
+    RandomAccessFile& operator=(const RandomAccessFile&) = delete;
+
+    // Opening for writing creates the file if it does not exist.
+    bool open(const char* path, bool writable)
+    {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ | (writable ? GENERIC_WRITE : 0), FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, writable ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        return file != INVALID_HANDLE_VALUE;
+#else
+        file = ::open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+        return file >= 0;
+#endif
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (file >= 0)
+            ::close(file);
+        file = -1;
+#endif
+    }
+
+    // Takes an exclusive lock on the file that lasts until it is closed, or returns false if another
+    // open file already holds it. The lock is advisory: it only keeps out others that take it too.
+    bool lockExclusively()
+    {
+#ifdef _WIN32
+        // Windows locks byte ranges and keeps everyone else from reading a locked range, so
+        // this locks one byte far past any data instead of the contents.
+        OVERLAPPED overlapped = { };
+        overlapped.OffsetHigh = 0x7FFFFFFF;
+        return LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped);
+#else
+        return !flock(file, LOCK_EX | LOCK_NB);
+#endif
+    }
+
+    // Returns false if the size cannot be read.
+    bool fileSize(uint64_t& size) const
+    {
+#ifdef _WIN32
+        LARGE_INTEGER value;
+        if (!GetFileSizeEx(file, &value))
+            return false;
+        size = static_cast<uint64_t>(value.QuadPart);
+#else
+        struct stat status;
+        if (fstat(file, &status))
+            return false;
+        size = static_cast<uint64_t>(status.st_size);
+#endif
+        return true;
+    }
+
+    // Reads or writes exactly length bytes, or returns false.
+    bool read(uint64_t offset, void* bytes, size_t length) const { return transfer(offset, bytes, length, false); }
+    bool write(uint64_t offset, const void* bytes, size_t length) { return transfer(offset, const_cast<void*>(bytes), length, true); }
+
+    bool sync()
+    {
+#ifdef _WIN32
+        return FlushFileBuffers(file);
+#else
+        return !fsync(file);
+#endif
+    }
+
+private:
+    bool transfer(uint64_t offset, void* bytes, size_t length, bool writing) const
+    {
+        uint8_t* position = reinterpret_cast<uint8_t*>(bytes);
+        while (length) {
+#ifdef _WIN32
+            const DWORD request = static_cast<DWORD>(std::min<size_t>(length, 1 << 30));
+            OVERLAPPED overlapped = { };
+            overlapped.Offset = static_cast<DWORD>(offset);
+            overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD done = 0;
+            const BOOL succeeded = writing ? WriteFile(file, position, request, &done, &overlapped) : ReadFile(file, position, request, &done, &overlapped);
+            if (!succeeded || !done)
+                return false;
+#else
+            const ssize_t done = writing ? pwrite(file, position, length, static_cast<off_t>(offset)) : pread(file, position, length, static_cast<off_t>(offset));
+            if (done <= 0) {
+                if (done < 0 && errno == EINTR)
+                    continue;
+                return false;
+            }
+#endif
+            position += done;
+            offset += done;
+            length -= done;
+        }
+        return true;
+    }
+
+#ifdef _WIN32
+    HANDLE file { INVALID_HANDLE_VALUE };
+#else
+    int file { -1 };
+#endif
+};
+
+}
@@ -26,14 +26,39 @@ THE SOFTWARE.
 
 //PageAllocator, by Alex Christensen
 //
-//Allocates 255 elements at a time, reducing the allocation time and the memory footprint.
+//Allocates up to 255 elements at a time, reducing the allocation time and the memory footprint.
 //OverheadSize of 4 is usually ideal to maintain alignment for access speed, but it can be reduced to 1 to reduce memory.
+//OverheadSize of 0 stores no index with each element: pages are aligned to a power of two so an element's page is found by masking its address and its index by dividing its offset by ElementSize.
+//This also aligns elements to the largest power of two dividing ElementSize, but a page holds fewer elements when 255 of them don't fit the power of two.
 //Deleting the PageAllocator frees each allocated element much faster than freeing them individually, such as deleting all nodes in the destructor of a TreeSet.
 //This is intended for the operator new and operator delete for classes like tree nodes that are a constant size and often allocated.
-//This allocator is not thread safe, so it must be protected by a mutex for multithread use
-//OverheadSize must be nonzero, ElementSize must be nonzero
+//Only the thread that constructs the PageAllocator may allocate from it without a mutex, or use ThreadSafePageAllocator.h
+//With RemoteFrees any thread may deallocate: other threads push the element onto a lock-free list in its page, and the owning thread takes those elements back at its next allocation
+//Without it only the owning thread may deallocate, and deallocate doesn't look up the calling thread
+//ElementSize must be nonzero
 
-template <size_t ElementSize, size_t OverheadSize=4>
+#include <stddef.h>
+#include <stdlib.h>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+#include <atomic>
+#include <new>
+#include <thread>
+
+//the largest power of two that is not more than Size
+template <size_t Size, size_t PowerOfTwo=1, bool Done=(PowerOfTwo*2>Size)>
+struct FloorPowerOfTwo
+{
+	static const size_t value=FloorPowerOfTwo<Size,PowerOfTwo*2>::value;
+};
+template <size_t Size, size_t PowerOfTwo>
+struct FloorPowerOfTwo<Size,PowerOfTwo,true>
+{
+	static const size_t value=PowerOfTwo;
+};
+
+template <size_t ElementSize, size_t OverheadSize=4, bool RemoteFrees=false>
 class PageAllocator
 {
 public:
@@ -41,9 +66,25 @@ public:
 	~PageAllocator();
 	void* allocate();
 	void deallocate(void*);
+	//deallocates like the owning thread does, for callers that hold one lock around every allocate and deallocate, which makes any thread the owner
+	void deallocateLocked(void*);
+
+	//the pages and the elements allocated from them, which include elements other threads deallocated that the owner hasn't taken back yet.
+	//these walk every page, and only the owning thread may call them
+	size_t pageCount() const;
+	size_t allocatedCount() const;
+
+	//the bytes of a page after its elements: the first available index, the number of allocated elements, padding, and the members after the element array
+	static const size_t PageTrailerSize=2+5*sizeof(void*);
+	//with no overhead each page is allocated at a multiple of PageAlignment, which is also its size
+	static const size_t PageAlignment=OverheadSize ? 0 : FloorPowerOfTwo<255*ElementSize+PageTrailerSize>::value;
+	static const size_t ElementsPerPage=OverheadSize ? 255 : (PageAlignment-PageTrailerSize)/ElementSize;
 private:
+	void deallocateLocal(unsigned char* element);
+	void deallocateRemote(unsigned char* element);
+	void reclaimRemoteFrees();
 
-	template <size_t ElementSize, size_t OverheadSize>
+	template <size_t PageElementSize, size_t PageOverheadSize>
 	struct Page
 	{
 
@@ -54,43 +95,65 @@ private:
 		// n_______i___n_______i___...n_______i___ft
 		// when it is full, the array would look like this with d being a byte used for a double:
 		// ddddddddi___ddddddddi___...ddddddddi___ft
+		// a PageAllocator<sizeof(double),0> has no i___ after each element:
+		// n_______n_______...n_______ft
 		
-		unsigned char elements[255*(ElementSize+OverheadSize)+2];
+		unsigned char elements[ElementsPerPage*(PageElementSize+PageOverheadSize)+2];
 
 		//two pointers for doubly linked lists of allocated pages
-		Page<ElementSize,OverheadSize>* nextPage;
-		Page<ElementSize,OverheadSize>* prevPage;
+		Page<PageElementSize,PageOverheadSize>* nextPage;
+		Page<PageElementSize,PageOverheadSize>* prevPage;
+
+		//elements deallocated by other threads, linked by their next element index like the available elements, 255 if there are none
+		std::atomic<unsigned char> remoteFreeIndex;
+		//the next page in the owner's list of pages with remote frees
+		Page<PageElementSize,PageOverheadSize>* nextRemotePage;
 
 		Page()
+			: remoteFreeIndex((unsigned char)255)
 		{
 			nextPage=0;
 			prevPage=0;
-			elements[255*(ElementSize+OverheadSize)+0]=(unsigned char)0;//first available index
-			elements[255*(ElementSize+OverheadSize)+1]=(unsigned char)0;//number of allocated elements
+			nextRemotePage=0;
+			elements[ElementsPerPage*(PageElementSize+PageOverheadSize)+0]=(unsigned char)0;//first available index
+			elements[ElementsPerPage*(PageElementSize+PageOverheadSize)+1]=(unsigned char)0;//number of allocated elements
 
 			//set up the indices and the indices of the following available element (like a singly linked list of indices)
-			for(unsigned char i=0;i<255;i++)
+			for(size_t i=0;i<ElementsPerPage;i++)
 			{
-				elements[i*(ElementSize+OverheadSize)+ElementSize]=i;//index of the element
-				elements[i*(ElementSize+OverheadSize)]=i+1;//index of the following available element
+				if(PageOverheadSize)
+					elements[i*(PageElementSize+PageOverheadSize)+PageElementSize]=(unsigned char)i;//index of the element
+				elements[i*(PageElementSize+PageOverheadSize)]=(unsigned char)(i+1);//index of the following available element
 			}
 		}
 	};
 
+	static Page<ElementSize,OverheadSize>* newPage();
+	static void deletePage(Page<ElementSize,OverheadSize>*);
+	static unsigned char indexOf(unsigned char* element);
+	static Page<ElementSize,OverheadSize>* pageOf(unsigned char* element, unsigned char index);
+
 	//keep a doubly linked list of full pages and a doubly linked list of pages with available allocation slots
 	Page<ElementSize, OverheadSize>* fullPages;
 	Page<ElementSize, OverheadSize>* notFullPages;//there is always at least one notFullPage, allocation always happens from the first notFullPage
+
+	//pages that other threads have deallocated elements into since the owner last looked, a lock-free stack that the owner takes all at once
+	std::atomic<Page<ElementSize, OverheadSize>*> pagesWithRemoteFrees;
+	std::thread::id owner;
 };
 
-template <size_t ElementSize,size_t OverheadSize>
-PageAllocator<ElementSize,OverheadSize>::PageAllocator()
+template <size_t ElementSize,size_t OverheadSize,bool RemoteFrees>
+PageAllocator<ElementSize,OverheadSize,RemoteFrees>::PageAllocator()
+	: pagesWithRemoteFrees((Page<ElementSize,OverheadSize>*)0)
+	, owner(std::this_thread::get_id())
 {
-	notFullPages=new Page<ElementSize,OverheadSize>();
+	static_assert(sizeof(Page<ElementSize,OverheadSize>)<=PageAlignment||OverheadSize,"the page trailer is larger than PageTrailerSize");
+	notFullPages=newPage();
 	fullPages=0;
 }
 
-template <size_t ElementSize, size_t OverheadSize>
-PageAllocator<ElementSize,OverheadSize>::~PageAllocator()
+template <size_t ElementSize,size_t OverheadSize,bool RemoteFrees>
+PageAllocator<ElementSize,OverheadSize,RemoteFrees>::~PageAllocator()
 {
 	//delete each allocated page from the 2 doubly linked lists
 	Page<ElementSize,OverheadSize>* pageToDelete=notFullPages;
@@ -98,28 +161,31 @@ PageAllocator<ElementSize,OverheadSize>::~PageAllocator()
 	{
 		Page<ElementSize,OverheadSize>* thisPage=pageToDelete;
 		pageToDelete=pageToDelete->nextPage;
-		delete thisPage;
+		deletePage(thisPage);
 	}
 	pageToDelete=fullPages;
 	while(pageToDelete)
 	{
 		Page<ElementSize,OverheadSize>* thisPage=pageToDelete;
 		pageToDelete=pageToDelete->nextPage;
-		delete thisPage;
+		deletePage(thisPage);
 	}
 }
 
-template <size_t ElementSize, size_t OverheadSize>
-void* PageAllocator<ElementSize,OverheadSize>::allocate()
+template <size_t ElementSize,size_t OverheadSize,bool RemoteFrees>
+void* PageAllocator<ElementSize,OverheadSize,RemoteFrees>::allocate()
 {
+	if(RemoteFrees&&pagesWithRemoteFrees.load(std::memory_order_relaxed))
+		reclaimRemoteFrees();
+
 	//allocate from the beginning of the singly linked list of indices
-	unsigned char* pFirstAvailableElementIndex=notFullPages->elements+255*(ElementSize+OverheadSize)+0;
-	unsigned char* pNumAllocatedElements      =notFullPages->elements+255*(ElementSize+OverheadSize)+1;
+	unsigned char* pFirstAvailableElementIndex=notFullPages->elements+ElementsPerPage*(ElementSize+OverheadSize)+0;
+	unsigned char* pNumAllocatedElements      =notFullPages->elements+ElementsPerPage*(ElementSize+OverheadSize)+1;
 	unsigned char* allocatedElement=(notFullPages->elements)+(ElementSize+OverheadSize)*(*pFirstAvailableElementIndex);
 	*pFirstAvailableElementIndex=*allocatedElement;
 
 	//increment the number of allocated elements and remove the page from notFullPages and insert into fullPages if it's full
-	if(++(*pNumAllocatedElements)==(unsigned char)255)//if it's full
+	if(++(*pNumAllocatedElements)==(unsigned char)ElementsPerPage)//if it's full
 	{
 		Page<ElementSize,OverheadSize>* page=notFullPages;
 
@@ -134,18 +200,34 @@ void* PageAllocator<ElementSize,OverheadSize>::allocate()
 
 		//allocate another notFullPage if there isn't one
 		if(notFullPages==0)
-			notFullPages=new Page<ElementSize,OverheadSize>();
+			notFullPages=newPage();
 	}
 	return allocatedElement;
 }
 
-template <size_t ElementSize,size_t OverheadSize>
-void PageAllocator<ElementSize,OverheadSize>::deallocate(void* element)
+template <size_t ElementSize,size_t OverheadSize,bool RemoteFrees>
+void PageAllocator<ElementSize,OverheadSize,RemoteFrees>::deallocate(void* element)
+{
+	if(!RemoteFrees||std::this_thread::get_id()==owner)
+		deallocateLocal((unsigned char*)element);
+	else
+		deallocateRemote((unsigned char*)element);
+}
+
+template <size_t ElementSize,size_t OverheadSize,bool RemoteFrees>
+void PageAllocator<ElementSize,OverheadSize,RemoteFrees>::deallocateLocked(void* element)
+{
+	deallocateLocal((unsigned char*)element);
+}
+
+template <size_t ElementSize,size_t OverheadSize,bool RemoteFrees>
+void PageAllocator<ElementSize,OverheadSize,RemoteFrees>::deallocateLocal(unsigned char* element)
 {
 	//put this element at the beginning of the singly linked list of indices and decrement the number of allocated elements
-	unsigned char index=((unsigned char*)element)[ElementSize];
-	unsigned char* pFirstAvailableElementIndex=((unsigned char*)element)+(255-index)*(ElementSize+OverheadSize)+0;
-	unsigned char* pNumAllocatedElements      =((unsigned char*)element)+(255-index)*(ElementSize+OverheadSize)+1;
+	unsigned char index=indexOf(element);
+	Page<ElementSize,OverheadSize>* page=pageOf(element,index);
+	unsigned char* pFirstAvailableElementIndex=page->elements+ElementsPerPage*(ElementSize+OverheadSize)+0;
+	unsigned char* pNumAllocatedElements      =page->elements+ElementsPerPage*(ElementSize+OverheadSize)+1;
 	*((unsigned char*)element)=*pFirstAvailableElementIndex;
 	*pFirstAvailableElementIndex=index;
 	(*pNumAllocatedElements)--;
@@ -153,7 +235,6 @@ void PageAllocator<ElementSize,OverheadSize>::deallocate(void* element)
 	if(*pNumAllocatedElements==0)
 	{
 		//remove the page from the notFullPages doubly linked list and delete the page if it's not the only notFullPage
-		Page<ElementSize,OverheadSize>* page=(Page<ElementSize,OverheadSize>*)(((unsigned char*)element)-index*(ElementSize+OverheadSize));
 		if(page->prevPage||page->nextPage)
 		{
 			if(page->nextPage)
@@ -162,13 +243,12 @@ void PageAllocator<ElementSize,OverheadSize>::deallocate(void* element)
 				page->prevPage->nextPage=page->nextPage;
 			else
 				notFullPages=page->nextPage;
-			delete page;
+			deletePage(page);
 		}
 	}
-	else if(*pNumAllocatedElements==254)
+	else if(*pNumAllocatedElements==ElementsPerPage-1)
 	{
 		//remove the page from the fullPages and insert it into the notFullPages if it was full (but isn't anymore)
-		Page<ElementSize,OverheadSize>* page=(Page<ElementSize,OverheadSize>*)(((unsigned char*)element)-index*(ElementSize+OverheadSize));
 		if(page->nextPage)
 			page->nextPage->prevPage=page->prevPage;
 		if(page->prevPage)
@@ -183,4 +263,122 @@ void PageAllocator<ElementSize,OverheadSize>::deallocate(void* element)
 	}
 }
 
+template <size_t ElementSize,size_t OverheadSize,bool RemoteFrees>
+size_t PageAllocator<ElementSize,OverheadSize,RemoteFrees>::pageCount() const
+{
+	size_t count=0;
+	for(Page<ElementSize,OverheadSize>* page=notFullPages;page;page=page->nextPage)
+		count++;
+	for(Page<ElementSize,OverheadSize>* page=fullPages;page;page=page->nextPage)
+		count++;
+	return count;
+}
+
+template <size_t ElementSize,size_t OverheadSize,bool RemoteFrees>
+size_t PageAllocator<ElementSize,OverheadSize,RemoteFrees>::allocatedCount() const
+{
+	size_t count=0;
+	for(Page<ElementSize,OverheadSize>* page=notFullPages;page;page=page->nextPage)
+		count+=page->elements[ElementsPerPage*(ElementSize+OverheadSize)+1];
+	for(Page<ElementSize,OverheadSize>* page=fullPages;page;page=page->nextPage)
+		count+=page->elements[ElementsPerPage*(ElementSize+OverheadSize)+1];
+	return count;
+}
+
+template <size_t ElementSize,size_t OverheadSize,bool RemoteFrees>
+void PageAllocator<ElementSize,OverheadSize,RemoteFrees>::deallocateRemote(unsigned char* element)
+{
+	//push this element onto its page's list of remote frees, linked through the same byte as the list of available elements
+	unsigned char index=indexOf(element);
+	Page<ElementSize,OverheadSize>* page=pageOf(element,index);
+	unsigned char nextIndex=page->remoteFreeIndex.load(std::memory_order_relaxed);
+	do
+		element[0]=nextIndex;
+	while(!page->remoteFreeIndex.compare_exchange_weak(nextIndex,index,std::memory_order_acq_rel,std::memory_order_acquire));
+
+	//the thread that makes the list nonempty tells the owner about the page.
+	//its CAS read the 255 that the owner stored after reading nextRemotePage, so the owner is done with the link.
+	//the page can't be deleted before the owner takes this element back, because the element still counts as allocated
+	if(nextIndex==(unsigned char)255)
+	{
+		Page<ElementSize,OverheadSize>* nextPage=pagesWithRemoteFrees.load(std::memory_order_relaxed);
+		do
+			page->nextRemotePage=nextPage;
+		while(!pagesWithRemoteFrees.compare_exchange_weak(nextPage,page,std::memory_order_release,std::memory_order_relaxed));
+	}
+}
+
+template <size_t ElementSize,size_t OverheadSize,bool RemoteFrees>
+void PageAllocator<ElementSize,OverheadSize,RemoteFrees>::reclaimRemoteFrees()
+{
+	//take every page and every element at once so that nothing is popped while other threads push, which avoids the ABA problem
+	Page<ElementSize,OverheadSize>* page=pagesWithRemoteFrees.exchange(0,std::memory_order_acquire);
+	while(page)
+	{
+		//read the link before emptying the page's list, after which another thread can push the page again
+		Page<ElementSize,OverheadSize>* nextPage=page->nextRemotePage;
+		unsigned char index=page->remoteFreeIndex.exchange((unsigned char)255,std::memory_order_acq_rel);
+		while(index!=(unsigned char)255)
+		{
+			//read the next index before deallocateLocal overwrites it or deletes the page with the last element
+			unsigned char* element=page->elements+index*(ElementSize+OverheadSize);
+			index=element[0];
+			deallocateLocal(element);
+		}
+		page=nextPage;
+	}
+}
+
+template <size_t ElementSize,size_t OverheadSize,bool RemoteFrees>
+typename PageAllocator<ElementSize,OverheadSize,RemoteFrees>::template Page<ElementSize,OverheadSize>* PageAllocator<ElementSize,OverheadSize,RemoteFrees>::newPage()
+{
+	if(OverheadSize)
+		return new Page<ElementSize,OverheadSize>();
+
+	void* memory;
+#ifdef _MSC_VER
+	memory=_aligned_malloc(PageAlignment,PageAlignment);
+#else
+	if(posix_memalign(&memory,PageAlignment,PageAlignment))
+		memory=0;
+#endif
+	if(!memory)
+		throw std::bad_alloc();
+	return new(memory) Page<ElementSize,OverheadSize>();
+}
+
+template <size_t ElementSize,size_t OverheadSize,bool RemoteFrees>
+void PageAllocator<ElementSize,OverheadSize,RemoteFrees>::deletePage(Page<ElementSize,OverheadSize>* page)
+{
+	if(OverheadSize)
+	{
+		delete page;
+		return;
+	}
+
+	page->~Page();
+#ifdef _MSC_VER
+	_aligned_free(page);
+#else
+	free(page);
+#endif
+}
+
+template <size_t ElementSize,size_t OverheadSize,bool RemoteFrees>
+inline unsigned char PageAllocator<ElementSize,OverheadSize,RemoteFrees>::indexOf(unsigned char* element)
+{
+	if(OverheadSize)
+		return element[ElementSize];
+	//the elements start at the beginning of the page, and the division by a constant compiles to a multiplication
+	return (unsigned char)(((size_t)element&(PageAlignment-1))/ElementSize);
+}
+
+template <size_t ElementSize,size_t OverheadSize,bool RemoteFrees>
+inline typename PageAllocator<ElementSize,OverheadSize,RemoteFrees>::template Page<ElementSize,OverheadSize>* PageAllocator<ElementSize,OverheadSize,RemoteFrees>::pageOf(unsigned char* element, unsigned char index)
+{
+	if(OverheadSize)
+		return (Page<ElementSize,OverheadSize>*)(element-index*(ElementSize+OverheadSize));
+	return (Page<ElementSize,OverheadSize>*)((size_t)element&~(PageAlignment-1));
+}
+
 #endif
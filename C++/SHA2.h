@@ -29,36 +29,331 @@ either expressed or implied, of the FreeBSD Project.
 *************************************************/
 
 #pragma once
+#include <algorithm>
 #include <array>
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+#include "CPUFeatures.h"
+#include "SHA2Instrumentation.h"
+
+#ifdef _MSC_VER
+#define SHA2_ALWAYS_INLINE __forceinline
+#else
+#define SHA2_ALWAYS_INLINE inline __attribute__((always_inline))
+#endif
 
 namespace SHA2 {
 
+inline uint32_t byteSwap(uint32_t value)
+{
+#ifdef _MSC_VER
+    return _byteswap_ulong(value);
+#else
+    return __builtin_bswap32(value);
+#endif
+}
+
+inline uint64_t byteSwap(uint64_t value)
+{
+#ifdef _MSC_VER
+    return _byteswap_uint64(value);
+#else
+    return __builtin_bswap64(value);
+#endif
+}
+
+// SHA-2 reads and writes its words big-endian, which is one load or store and a bswap on little-endian machines.
+template<typename Integer>
+inline Integer loadBigEndian(const uint8_t* bytes)
+{
+    Integer value;
+    memcpy(&value, bytes, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return value;
+#else
+    return byteSwap(value);
+#endif
+}
+
+template<typename Integer>
+inline void storeBigEndian(uint8_t* bytes, Integer value)
+{
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+    value = byteSwap(value);
+#endif
+    memcpy(bytes, &value, sizeof(value));
+}
+
+// A contiguous range of bytes, such as one message of a batch or one segment of a scattered message.
+struct Span {
+    const void* data;
+    size_t length;
+};
+
+constexpr std::array<uint32_t, 64> RoundConstants32 = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+constexpr std::array<uint64_t, 80> RoundConstants64 = {
+    0x428a2f98d728ae22, 0x7137449123ef65cd, 0xb5c0fbcfec4d3b2f, 0xe9b5dba58189dbbc, 0x3956c25bf348b538, 
+    0x59f111f1b605d019, 0x923f82a4af194f9b, 0xab1c5ed5da6d8118, 0xd807aa98a3030242, 0x12835b0145706fbe, 
+    0x243185be4ee4b28c, 0x550c7dc3d5ffb4e2, 0x72be5d74f27b896f, 0x80deb1fe3b1696b1, 0x9bdc06a725c71235, 
+    0xc19bf174cf692694, 0xe49b69c19ef14ad2, 0xefbe4786384f25e3, 0x0fc19dc68b8cd5b5, 0x240ca1cc77ac9c65, 
+    0x2de92c6f592b0275, 0x4a7484aa6ea6e483, 0x5cb0a9dcbd41fbd4, 0x76f988da831153b5, 0x983e5152ee66dfab, 
+    0xa831c66d2db43210, 0xb00327c898fb213f, 0xbf597fc7beef0ee4, 0xc6e00bf33da88fc2, 0xd5a79147930aa725, 
+    0x06ca6351e003826f, 0x142929670a0e6e70, 0x27b70a8546d22ffc, 0x2e1b21385c26c926, 0x4d2c6dfc5ac42aed, 
+    0x53380d139d95b3df, 0x650a73548baf63de, 0x766a0abb3c77b2a8, 0x81c2c92e47edaee6, 0x92722c851482353b, 
+    0xa2bfe8a14cf10364, 0xa81a664bbc423001, 0xc24b8b70d0f89791, 0xc76c51a30654be30, 0xd192e819d6ef5218, 
+    0xd69906245565a910, 0xf40e35855771202a, 0x106aa07032bbd1b8, 0x19a4c116b8d2d0c8, 0x1e376c085141ab53, 
+    0x2748774cdf8eeb99, 0x34b0bcb5e19b48a8, 0x391c0cb3c5c95a63, 0x4ed8aa4ae3418acb, 0x5b9cca4f7763e373, 
+    0x682e6ff3d6b2b8a3, 0x748f82ee5defb2fc, 0x78a5636f43172f60, 0x84c87814a1f0ab72, 0x8cc702081a6439ec, 
+    0x90befffa23631e28, 0xa4506cebde82bde9, 0xbef9a3f7b2c67915, 0xc67178f2e372532b, 0xca273eceea26619c, 
+    0xd186b8c721c0c207, 0xeada7dd6cde0eb1e, 0xf57d4f7fee6ed178, 0x06f067aa72176fba, 0x0a637dc5a2c898a6, 
+    0x113f9804bef90dae, 0x1b710b35131c471b, 0x28db77f523047d84, 0x32caab7b40c72493, 0x3c9ebe0a15c9bebc, 
+    0x431d67c49c100d4c, 0x4cc5d4becb3e42b6, 0x597f299cfc657e2a, 0x5fcb6fab3ad6faec, 0x6c44198c4a475817
+};
+
+constexpr std::array<size_t, 12> ShiftConstants32 = { 7, 18, 3, 17, 19, 10, 6, 11, 25, 2, 13, 22 };
+constexpr std::array<size_t, 12> ShiftConstants64 = { 1, 8, 7, 19, 61, 6, 14, 18, 41, 28, 34, 39 };
+constexpr std::array<uint32_t, 8> InitialSHA224Hash = { 0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939, 0xffc00b31, 0x68581511, 0x64f98fa7, 0xbefa4fa4 };
+constexpr std::array<uint32_t, 8> InitialSHA256Hash = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+constexpr std::array<uint64_t, 8> InitialSHA314Hash = { 0xcbbb9d5dc1059ed8, 0x629a292a367cd507, 0x9159015a3070dd17, 0x152fecd8f70e5939, 0x67332667ffc00b31, 0x8eb44a8768581511, 0xdb0c2e0d64f98fa7, 0x47b5481dbefa4fa4 };
+constexpr std::array<uint64_t, 8> InitialSHA512Hash = { 0x6a09e667f3bcc908, 0xbb67ae8584caa73b, 0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1, 0x510e527fade682d1, 0x9b05688c2b3e6c1f, 0x1f83d9abfb41bd6b, 0x5be0cd19137e2179 };
+
+
+// Compresses count whole blocks into a SHA-224 or SHA-256 state, like SHA256Extensions::compress.
+using SHA256CompressFunction = void (*)(uint32_t* state, const uint8_t* blocks, size_t count);
+
+// When this is set, SHA-224 and SHA-256 compress with it instead of their built-in kernels,
+// such as with a kernel generated for the host at run time. Set it before any thread hashes.
+inline SHA256CompressFunction& customSHA256Compression()
+{
+    static SHA256CompressFunction compress = nullptr;
+    return compress;
+}
+
+#ifdef SHA2_X86
+
+// SHA-256 compression with the SHA extensions, which do two rounds per sha256rnds2
+// and most of the message schedule with sha256msg1 and sha256msg2.
+// The state stays in registers across all the blocks.
+struct SHA256Extensions {
+    SHA2_TARGET("sha,sse4.1,ssse3")
+    static void compress(uint32_t* state, const uint8_t* blocks, size_t count)
+    {
+        const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+
+        // sha256rnds2 wants the state as ABEF and CDGH instead of ABCD and EFGH.
+        __m128i dcba = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state));
+        __m128i hgfe = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4));
+        __m128i cdab = _mm_shuffle_epi32(dcba, 0xB1);
+        __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1B);
+        __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+        __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+        for (; count; --count, blocks += 64) {
+            const __m128i previousABEF = abef;
+            const __m128i previousCDGH = cdgh;
+            __m128i w[4];
+            for (size_t i = 0; i < 4; ++i)
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 16 * i)), byteSwap);
+            for (size_t i = 0; i < 16; ++i) {
+                // w[i & 3] holds words 4i-16 to 4i-13 here, and the other three hold the twelve words after them.
+                if (i >= 4) {
+                    __m128i w7 = _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4);
+                    w[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]), w7), w[(i + 3) & 3]);
+                }
+                __m128i wk = _mm_add_epi32(w[i & 3], _mm_loadu_si128(reinterpret_cast<const __m128i*>(RoundConstants32.data() + 4 * i)));
+                cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+                abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0E));
+            }
+            abef = _mm_add_epi32(abef, previousABEF);
+            cdgh = _mm_add_epi32(cdgh, previousCDGH);
+        }
+
+        __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+        __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_blend_epi16(feba, dchg, 0xF0));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+    }
+};
+
+// Expands the SHA-512 message schedules of two blocks at once with AVX2. Word pair j of
+// both schedules shares one vector: words 2j and 2j + 1 of the first block in the low half
+// and the same words of the second block in the high half. SHA-512 has no rotate
+// instruction before AVX-512, so rotations are two shifts and an or.
+struct SHA512AVX2Schedule {
+    // Loads the sixteen message words of both blocks into w[0] through w[7].
+    SHA2_TARGET("avx2")
+    static void load(const uint8_t* first, const uint8_t* second, __m256i (&w)[8])
+    {
+        const __m256i byteSwap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+            7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        for (size_t j = 0; j < 8; ++j) {
+            __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first + 16 * j));
+            __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(second + 16 * j));
+            w[j] = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1), byteSwap);
+        }
+    }
+
+    // Replaces w[j & 7], which holds words 2j - 16 and 2j - 15, with words 2j and 2j + 1.
+    SHA2_TARGET("avx2")
+    static void expand(__m256i (&w)[8], size_t j)
+    {
+        __m256i w15 = _mm256_alignr_epi8(w[(j + 1) & 7], w[j & 7], 8);
+        __m256i w7 = _mm256_alignr_epi8(w[(j + 5) & 7], w[(j + 4) & 7], 8);
+        __m256i w2 = w[(j + 7) & 7];
+        __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotateRight<1>(w15), rotateRight<8>(w15)), _mm256_srli_epi64(w15, 7));
+        __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotateRight<19>(w2), rotateRight<61>(w2)), _mm256_srli_epi64(w2, 6));
+        w[j & 7] = _mm256_add_epi64(_mm256_add_epi64(w[j & 7], s0), _mm256_add_epi64(w7, s1));
+    }
+
+    // Adds the round constants to word pair j and stores it in both schedules.
+    SHA2_TARGET("avx2")
+    static void store(__m256i w, size_t j, uint64_t (&wk)[2][80])
+    {
+        __m256i k = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(RoundConstants64.data() + 2 * j)));
+        __m256i sum = _mm256_add_epi64(w, k);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(wk[0] + 2 * j), _mm256_castsi256_si128(sum));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(wk[1] + 2 * j), _mm256_extracti128_si256(sum, 1));
+    }
+
+private:
+    template<int Bits>
+    SHA2_TARGET("avx2")
+    static __m256i rotateRight(__m256i x) { return _mm256_or_si256(_mm256_srli_epi64(x, Bits), _mm256_slli_epi64(x, 64 - Bits)); }
+};
+
+#endif
+
 template<typename RegisterType, size_t DigestSize, const std::array<RegisterType, 8>& InitialHash, size_t Rounds, const std::array<RegisterType, Rounds>& RoundConstants, const std::array<size_t, 12>& ShiftConstants>
 class SHA2 {
 public:
-    std::array<RegisterType, DigestSize> digest() { finalize(); return digestTemplate<DigestSize>(); }
+    using Register = RegisterType;
+    using Digest = std::array<RegisterType, DigestSize>;
+    static constexpr size_t BlockSizeBytes = 16 * sizeof(RegisterType);
+    static const std::array<RegisterType, 8>& initialHash() { return InitialHash; }
+
+    // Everything a hash needs to continue after the bytes it has seen so far. Hashing a
+    // common prefix once and starting each message from its midstate skips the prefix.
+    struct Midstate {
+        std::array<RegisterType, 8> state;
+        uint64_t length;
+        uint8_t buffer[BlockSizeBytes];
+        size_t bufferContents;
+    };
+
+    SHA2() = default;
+    explicit SHA2(const Midstate& midstate)
+        : state(midstate.state)
+        , length(midstate.length)
+        , bufferContents(midstate.bufferContents)
+    {
+        assert(bufferContents < BlockSizeBytes);
+        memcpy(buffer, midstate.buffer, bufferContents);
+    }
+
+    Midstate midstate() const
+    {
+        assert(!finalized);
+        Midstate midstate;
+        midstate.state = state;
+        midstate.length = length;
+        memcpy(midstate.buffer, buffer, bufferContents);
+        memset(midstate.buffer + bufferContents, 0, BlockSizeBytes - bufferContents);
+        midstate.bufferContents = bufferContents;
+        return midstate;
+    }
+
+    Digest digest() { finalize(); return digestTemplate<DigestSize>(); }
+
+    // Hashes a whole message without staging anything in the buffer: the whole blocks are
+    // compressed where they are and only the padded final blocks are built on the stack.
+    static Digest digest(const void* input, size_t length)
+    {
+        SHA2_COUNT_BYTES(length);
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(input);
+        const size_t wholeBlocks = length / BlockSizeBytes;
+        SHA2 hash;
+        hash.addBlocks(bytes, wholeBlocks);
+        uint8_t finalBlocks[BlockSizeBytes * 2];
+        hash.addBlocks(finalBlocks, padFinalBlocks(finalBlocks, bytes + wholeBlocks * BlockSizeBytes, length % BlockSizeBytes, length));
+        return hash.digestTemplate<DigestSize>();
+    }
+
+    // Hashes while compiling when used in a constant expression, such as
+    //     constexpr SHA256::Digest tag = SHA256::constexprDigest("protocol tag");
+    // This reads the padded message a byte at a time, so at run time the streaming interface is much faster.
+    template<typename Byte>
+    static constexpr Digest constexprDigest(const Byte* bytes, size_t length)
+    {
+        constexpr size_t LengthSizeBytes = 2 * sizeof(RegisterType);
+        const size_t paddedLength = (length + 1 + LengthSizeBytes + BlockSizeBytes - 1) / BlockSizeBytes * BlockSizeBytes;
+        RegisterType state[8] = { InitialHash[0], InitialHash[1], InitialHash[2], InitialHash[3], InitialHash[4], InitialHash[5], InitialHash[6], InitialHash[7] };
+        for (size_t block = 0; block < paddedLength; block += BlockSizeBytes) {
+            RegisterType w[Rounds] = { };
+            for (size_t i = 0; i < 16; ++i) {
+                for (size_t j = 0; j < sizeof(RegisterType); ++j)
+                    w[i] = (w[i] << 8) | paddedByte(bytes, length, paddedLength, block + i * sizeof(RegisterType) + j);
+            }
+            constexprCompress(state, w);
+        }
+        return constexprDigestFromState(state, std::make_index_sequence<DigestSize>());
+    }
+
+    // Hashes a string literal without its null terminator.
+    template<size_t Length>
+    static constexpr Digest constexprDigest(const char (&string)[Length])
+    {
+        return constexprDigest(string, Length - 1);
+    }
     void addBytes(const void* input, size_t length) {
         assert(!finalized);
         const uint8_t* bytes = reinterpret_cast<const uint8_t*>(input);
         const uint8_t* end = bytes + length;
         this->length += length;
+        SHA2_COUNT_BYTES(length);
 
         if (bufferContents) {
-            while (bufferContents < BlockSizeBytes && bytes < end)
-                buffer[bufferContents++] = *bytes++;
-            if (bufferContents == BlockSizeBytes) {
-                addBlock(buffer);
-                bufferContents = 0;
+            const size_t staged = std::min<size_t>(BlockSizeBytes - bufferContents, length);
+            {
+                SHA2_MEASURE_STAGING();
+                memcpy(buffer + bufferContents, bytes, staged);
             }
+            bufferContents += staged;
+            bytes += staged;
+            if (bufferContents < BlockSizeBytes)
+                return;
+            addBlocks(buffer, 1);
+            bufferContents = 0;
         }
-        while (end - bytes >= BlockSizeBytes) {
-            addBlock(bytes);
-            bytes += BlockSizeBytes;
+        const size_t blocks = (end - bytes) / BlockSizeBytes;
+        addBlocks(bytes, blocks);
+        bytes += blocks * BlockSizeBytes;
+        bufferContents = end - bytes;
+        if (bufferContents) {
+            SHA2_MEASURE_STAGING();
+            memcpy(buffer, bytes, bufferContents);
         }
-        while (bytes < end)
-            buffer[bufferContents++] = *bytes++;
+    }
+
+    // Hashes the segments as one message in order. Whole blocks are compressed where they
+    // are, and only blocks that straddle two segments are copied into the buffer.
+    void addSegments(const Span* segments, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+            addBytes(segments[i].data, segments[i].length);
     }
 
 private:
@@ -67,55 +362,78 @@ private:
             return;
         finalized = true;
 
-        const uint8_t* bytes = buffer;
-        size_t i = 0;
-        while (i + BlockSizeBytes <= bufferContents) {
-            addBlock(bytes + i);
-            i += BlockSizeBytes;
-        }
-
         uint8_t finalBlocks[BlockSizeBytes * 2];
-        size_t j = 0;
-        while (i < bufferContents)
-            finalBlocks[j++] = bytes[i++];
-        finalBlocks[j++] = 0x80;
-        uint64_t l = length * 8;
-        static constexpr size_t PaddingSize = sizeof(RegisterType) == 4 ? sizeof(uint64_t) : 2 * sizeof(uint64_t);
-        if (j < BlockSizeBytes - PaddingSize) {
-            while (j < BlockSizeBytes - sizeof(uint64_t))
-                finalBlocks[j++] = 0x00;
-            finalBlocks[BlockSizeBytes - sizeof(uint64_t) + 0] = l >> 56;
-            finalBlocks[BlockSizeBytes - sizeof(uint64_t) + 1] = l >> 48;
-            finalBlocks[BlockSizeBytes - sizeof(uint64_t) + 2] = l >> 40;
-            finalBlocks[BlockSizeBytes - sizeof(uint64_t) + 3] = l >> 32;
-            finalBlocks[BlockSizeBytes - sizeof(uint64_t) + 4] = l >> 24;
-            finalBlocks[BlockSizeBytes - sizeof(uint64_t) + 5] = l >> 16;
-            finalBlocks[BlockSizeBytes - sizeof(uint64_t) + 6] = l >> 8;
-            finalBlocks[BlockSizeBytes - sizeof(uint64_t) + 7] = l;
-            addBlock(finalBlocks);
-        } else {
-            while (j < 2 * BlockSizeBytes - sizeof(uint64_t))
-                finalBlocks[j++] = 0x00;
-            finalBlocks[2 * BlockSizeBytes - sizeof(uint64_t) + 0] = l >> 56;
-            finalBlocks[2 * BlockSizeBytes - sizeof(uint64_t) + 1] = l >> 48;
-            finalBlocks[2 * BlockSizeBytes - sizeof(uint64_t) + 2] = l >> 40;
-            finalBlocks[2 * BlockSizeBytes - sizeof(uint64_t) + 3] = l >> 32;
-            finalBlocks[2 * BlockSizeBytes - sizeof(uint64_t) + 4] = l >> 24;
-            finalBlocks[2 * BlockSizeBytes - sizeof(uint64_t) + 5] = l >> 16;
-            finalBlocks[2 * BlockSizeBytes - sizeof(uint64_t) + 6] = l >> 8;
-            finalBlocks[2 * BlockSizeBytes - sizeof(uint64_t) + 7] = l;
-            addBlock(finalBlocks);
-            addBlock(finalBlocks + BlockSizeBytes);
-        }
+        addBlocks(finalBlocks, padFinalBlocks(finalBlocks, buffer, bufferContents, length));
         bufferContents = 0;
     }
 
+    // Writes the message tail, the 0x80 byte, zeros and the length in bits into one or two
+    // blocks, and returns how many blocks it used.
+    static size_t padFinalBlocks(uint8_t (&finalBlocks)[BlockSizeBytes * 2], const uint8_t* tail, size_t tailLength, uint64_t messageLength)
+    {
+        static constexpr size_t LengthSizeBytes = 2 * sizeof(RegisterType);
+        const size_t blocks = tailLength + 1 + LengthSizeBytes <= BlockSizeBytes ? 1 : 2;
+        const size_t end = blocks * BlockSizeBytes;
+        if (tailLength)
+            memcpy(finalBlocks, tail, tailLength);
+        finalBlocks[tailLength] = 0x80;
+        memset(finalBlocks + tailLength + 1, 0, end - sizeof(uint64_t) - tailLength - 1);
+        storeBigEndian<uint64_t>(finalBlocks + end - sizeof(uint64_t), messageLength * 8);
+        return blocks;
+    }
+
     template<size_t ArrayLength, typename std::enable_if_t<ArrayLength == 6>* = nullptr>
-    std::array<RegisterType, ArrayLength> digestTemplate() { return { h0, h1, h2, h3, h4, h5 }; }
+    std::array<RegisterType, ArrayLength> digestTemplate() { return { state[0], state[1], state[2], state[3], state[4], state[5] }; }
     template<size_t ArrayLength, typename std::enable_if_t<ArrayLength == 7>* = nullptr>
-    std::array<RegisterType, ArrayLength> digestTemplate() { return { h0, h1, h2, h3, h4, h5, h6 }; }
+    std::array<RegisterType, ArrayLength> digestTemplate() { return { state[0], state[1], state[2], state[3], state[4], state[5], state[6] }; }
     template<size_t ArrayLength, typename std::enable_if_t<ArrayLength == 8>* = nullptr>
-    std::array<RegisterType, ArrayLength> digestTemplate() { return { h0, h1, h2, h3, h4, h5, h6, h7 }; }
+    std::array<RegisterType, ArrayLength> digestTemplate() { return { state[0], state[1], state[2], state[3], state[4], state[5], state[6], state[7] }; }
+
+    template<typename Byte>
+    static constexpr uint8_t paddedByte(const Byte* bytes, size_t length, size_t paddedLength, size_t index)
+    {
+        if (index < length)
+            return static_cast<uint8_t>(bytes[index]);
+        if (index == length)
+            return 0x80;
+        const size_t fromEnd = paddedLength - 1 - index;
+        return fromEnd < sizeof(uint64_t) ? static_cast<uint8_t>((static_cast<uint64_t>(length) * 8) >> (8 * fromEnd)) : 0;
+    }
+
+    static constexpr RegisterType constexprRotateRight(RegisterType bits, size_t bitsToRotate)
+    {
+        return (bits >> bitsToRotate) | (bits << (sizeof(RegisterType) * 8 - bitsToRotate));
+    }
+
+    // addBlock with everything in locals, because constant expressions cannot change members.
+    static constexpr void constexprCompress(RegisterType (&state)[8], RegisterType (&w)[Rounds])
+    {
+        for (size_t i = 16; i < Rounds; ++i) {
+            RegisterType s0 = constexprRotateRight(w[i - 15], ShiftConstants[0]) ^ constexprRotateRight(w[i - 15], ShiftConstants[1]) ^ (w[i - 15] >> ShiftConstants[2]);
+            RegisterType s1 = constexprRotateRight(w[i - 2], ShiftConstants[3]) ^ constexprRotateRight(w[i - 2], ShiftConstants[4]) ^ (w[i - 2] >> ShiftConstants[5]);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        RegisterType v[8] = { state[0], state[1], state[2], state[3], state[4], state[5], state[6], state[7] };
+        for (size_t i = 0; i < Rounds; ++i) {
+            RegisterType S1 = constexprRotateRight(v[4], ShiftConstants[6]) ^ constexprRotateRight(v[4], ShiftConstants[7]) ^ constexprRotateRight(v[4], ShiftConstants[8]);
+            RegisterType ch = (v[4] & v[5]) ^ ((~v[4]) & v[6]);
+            RegisterType t1 = v[7] + S1 + ch + RoundConstants[i] + w[i];
+            RegisterType S0 = constexprRotateRight(v[0], ShiftConstants[9]) ^ constexprRotateRight(v[0], ShiftConstants[10]) ^ constexprRotateRight(v[0], ShiftConstants[11]);
+            RegisterType maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+            for (size_t j = 7; j; --j)
+                v[j] = v[j - 1];
+            v[4] += t1;
+            v[0] = t1 + S0 + maj;
+        }
+        for (size_t i = 0; i < 8; ++i)
+            state[i] += v[i];
+    }
+
+    template<size_t... Indices>
+    static constexpr Digest constexprDigestFromState(const RegisterType (&state)[8], std::index_sequence<Indices...>)
+    {
+        return {{ state[Indices]... }};
+    }
 
     template<typename Integer>
     Integer rotateRight(Integer bits, size_t bitsToRotate)
@@ -123,70 +441,133 @@ private:
         return (bits >> bitsToRotate) | (bits << (sizeof(Integer) * 8 - bitsToRotate));
     }
 
-    template<typename Integer>
-    Integer readBits(const uint8_t* bytes)
+    // The SHA extensions only implement the 32-bit functions, so they are used for SHA-224 and SHA-256.
+    static constexpr bool HasSHA256Extensions = sizeof(RegisterType) == 4 && Rounds == 64;
+
+    void addBlocks(const uint8_t* blocks, size_t count)
     {
-        Integer value = bytes[0];
-        for (size_t i = 1; i < sizeof(Integer); ++i) {
-            value <<= 8;
-            value |= bytes[i];
+        if (!count)
+            return;
+        SHA2_MEASURE_COMPRESSION(count);
+        if (HasSHA256Extensions && customSHA256Compression()) {
+            customSHA256Compression()(reinterpret_cast<uint32_t*>(state.data()), blocks, count);
+            return;
         }
-        return value;
+#ifdef SHA2_X86
+        if (HasSHA256Extensions && CPUFeatures::host().sha) {
+            SHA256Extensions::compress(reinterpret_cast<uint32_t*>(state.data()), blocks, count);
+            return;
+        }
+        if (sizeof(RegisterType) == 8 && CPUFeatures::host().avx2) {
+            for (; count >= 2; count -= 2, blocks += 2 * BlockSizeBytes)
+                addBlockPair<RegisterType>(blocks);
+        }
+#endif
+        for (size_t i = 0; i < count; ++i)
+            addBlock(blocks + i * BlockSizeBytes);
     }
 
-    void addBlock(const uint8_t* block)
+    // One round with the roles of the working variables given by the argument order,
+    // so eight calls with rotated arguments replace moving the variables between rounds.
+    SHA2_ALWAYS_INLINE void round(RegisterType a, RegisterType b, RegisterType c, RegisterType& d, RegisterType e, RegisterType f, RegisterType g, RegisterType& h, RegisterType wk)
     {
-        RegisterType w[Rounds];
-        for (size_t i = 0; i < 16; ++i)
-            w[i] = readBits<RegisterType>(block + i * sizeof(RegisterType));
-        for (size_t i = 16; i < Rounds; ++i) {
-            RegisterType s0 = rotateRight(w[i - 15], ShiftConstants[0]) ^ rotateRight(w[i - 15], ShiftConstants[1]) ^ (w[i - 15] >> ShiftConstants[2]);
-            RegisterType s1 = rotateRight(w[i - 2], ShiftConstants[3]) ^ rotateRight(w[i - 2], ShiftConstants[4]) ^ (w[i - 2] >> ShiftConstants[5]);
-            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        RegisterType S1 = rotateRight(e, ShiftConstants[6]) ^ rotateRight(e, ShiftConstants[7]) ^ rotateRight(e, ShiftConstants[8]);
+        RegisterType ch = (e & f) ^ ((~e) & g);
+        RegisterType t1 = h + S1 + ch + wk;
+        RegisterType S0 = rotateRight(a, ShiftConstants[9]) ^ rotateRight(a, ShiftConstants[10]) ^ rotateRight(a, ShiftConstants[11]);
+        RegisterType maj = (a & b) ^ (a & c) ^ (b & c);
+        d += t1;
+        h = t1 + S0 + maj;
+    }
+
+    void eightRounds(RegisterType (&v)[8], const RegisterType* wk)
+    {
+        round(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], wk[0]);
+        round(v[7], v[0], v[1], v[2], v[3], v[4], v[5], v[6], wk[1]);
+        round(v[6], v[7], v[0], v[1], v[2], v[3], v[4], v[5], wk[2]);
+        round(v[5], v[6], v[7], v[0], v[1], v[2], v[3], v[4], wk[3]);
+        round(v[4], v[5], v[6], v[7], v[0], v[1], v[2], v[3], wk[4]);
+        round(v[3], v[4], v[5], v[6], v[7], v[0], v[1], v[2], wk[5]);
+        round(v[2], v[3], v[4], v[5], v[6], v[7], v[0], v[1], wk[6]);
+        round(v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[0], wk[7]);
+    }
+
+#ifdef SHA2_X86
+    // Compresses two SHA-512 blocks. Both message schedules are expanded together in vector
+    // registers, eight words ahead of the rounds of the first block, so the schedule of the
+    // second block is ready when its rounds start.
+    template<typename Integer, typename std::enable_if_t<sizeof(Integer) == 8>* = nullptr>
+    SHA2_TARGET("avx2")
+    void addBlockPair(const uint8_t* blocks)
+    {
+        uint64_t wk[2][80];
+        __m256i w[8];
+        SHA512AVX2Schedule::load(blocks, blocks + BlockSizeBytes, w);
+        for (size_t j = 0; j < 8; ++j)
+            SHA512AVX2Schedule::store(w[j], j, wk);
+
+        RegisterType v[8];
+        for (size_t i = 0; i < 8; ++i)
+            v[i] = state[i];
+        for (size_t i = 0; i < Rounds; i += 8) {
+            for (size_t j = (i + 16) / 2; j < (i + 24) / 2 && j < Rounds / 2; ++j) {
+                SHA512AVX2Schedule::expand(w, j);
+                SHA512AVX2Schedule::store(w[j & 7], j, wk);
+            }
+            eightRounds(v, wk[0] + i);
         }
-        RegisterType a = h0;
-        RegisterType b = h1;
-        RegisterType c = h2;
-        RegisterType d = h3;
-        RegisterType e = h4;
-        RegisterType f = h5;
-        RegisterType g = h6;
-        RegisterType h = h7;
-        for (size_t i = 0; i < Rounds; ++i) {
-            RegisterType S1 = rotateRight(e, ShiftConstants[6]) ^ rotateRight(e, ShiftConstants[7]) ^ rotateRight(e, ShiftConstants[8]);
-            RegisterType ch = (e & f) ^ ((~e) & g);
-            RegisterType t1 = h + S1 + ch + RoundConstants[i] + w[i];
-            RegisterType S0 = rotateRight(a, ShiftConstants[9]) ^ rotateRight(a, ShiftConstants[10]) ^ rotateRight(a, ShiftConstants[11]);
-            RegisterType maj = (a & b) ^ (a & c) ^ (b & c);
-            RegisterType t2 = S0 + maj;
-            h = g;
-            g = f;
-            f = e;
-            e = d + t1;
-            d = c;
-            c = b;
-            b = a;
-            a = t1 + t2;
+        for (size_t i = 0; i < 8; ++i) {
+            state[i] += v[i];
+            v[i] = state[i];
         }
-        h0 += a;
-        h1 += b;
-        h2 += c;
-        h3 += d;
-        h4 += e;
-        h5 += f;
-        h6 += g;
-        h7 += h;
+        for (size_t i = 0; i < Rounds; i += 8)
+            eightRounds(v, wk[1] + i);
+        for (size_t i = 0; i < 8; ++i)
+            state[i] += v[i];
     }
+    template<typename Integer, typename std::enable_if_t<sizeof(Integer) != 8>* = nullptr>
+    void addBlockPair(const uint8_t*) { }
+#endif
 
-    static constexpr size_t BlockSizeBytes = 16 * sizeof(RegisterType);
-    RegisterType h0 { InitialHash[0] };
-    RegisterType h1 { InitialHash[1] };
-    RegisterType h2 { InitialHash[2] };
-    RegisterType h3 { InitialHash[3] };
-    RegisterType h4 { InitialHash[4] };
-    RegisterType h5 { InitialHash[5] };
-    RegisterType h6 { InitialHash[6] };
-    RegisterType h7 { InitialHash[7] };
+    // One round of addBlock. The roles of the working variables move one place per round through
+    // the constant indices instead of by copying, and the message schedule is a window of 16 words
+    // where word Round replaces word Round - 16, the oldest one it depends on.
+    template<size_t Round>
+    SHA2_ALWAYS_INLINE void unrolledRound(RegisterType (&v)[8], RegisterType (&w)[16])
+    {
+        if (Round >= 16) {
+            const RegisterType w15 = w[(Round + 1) & 15];
+            const RegisterType w2 = w[(Round + 14) & 15];
+            RegisterType s0 = rotateRight(w15, ShiftConstants[0]) ^ rotateRight(w15, ShiftConstants[1]) ^ (w15 >> ShiftConstants[2]);
+            RegisterType s1 = rotateRight(w2, ShiftConstants[3]) ^ rotateRight(w2, ShiftConstants[4]) ^ (w2 >> ShiftConstants[5]);
+            w[Round & 15] += s0 + w[(Round + 9) & 15] + s1;
+        }
+        const size_t r = 8 - Round % 8;
+        round(v[r % 8], v[(r + 1) % 8], v[(r + 2) % 8], v[(r + 3) % 8], v[(r + 4) % 8], v[(r + 5) % 8], v[(r + 6) % 8], v[(r + 7) % 8], RoundConstants[Round] + w[Round & 15]);
+    }
+
+    template<size_t... RoundIndices>
+    SHA2_ALWAYS_INLINE void unrolledRounds(RegisterType (&v)[8], RegisterType (&w)[16], std::index_sequence<RoundIndices...>)
+    {
+        int rounds[] = { (unrolledRound<RoundIndices>(v, w), 0)... };
+        (void)rounds;
+    }
+
+    // The portable compression, fully unrolled so the working variables and the schedule window stay in registers.
+    void addBlock(const uint8_t* block)
+    {
+        RegisterType w[16];
+        for (size_t i = 0; i < 16; ++i)
+            w[i] = loadBigEndian<RegisterType>(block + i * sizeof(RegisterType));
+        RegisterType v[8];
+        for (size_t i = 0; i < 8; ++i)
+            v[i] = state[i];
+        unrolledRounds(v, w, std::make_index_sequence<Rounds>());
+        for (size_t i = 0; i < 8; ++i)
+            state[i] += v[i];
+    }
+
+    std::array<RegisterType, 8> state { InitialHash };
     
     uint64_t length { 0 };
     uint8_t buffer[BlockSizeBytes];
@@ -194,42 +575,17 @@ private:
     bool finalized { false };
 };
 
-constexpr std::array<uint32_t, 64> RoundConstants32 = {
-    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
-};
-
-constexpr std::array<uint64_t, 80> RoundConstants64 = {
-    0x428a2f98d728ae22, 0x7137449123ef65cd, 0xb5c0fbcfec4d3b2f, 0xe9b5dba58189dbbc, 0x3956c25bf348b538, 
-    0x59f111f1b605d019, 0x923f82a4af194f9b, 0xab1c5ed5da6d8118, 0xd807aa98a3030242, 0x12835b0145706fbe, 
-    0x243185be4ee4b28c, 0x550c7dc3d5ffb4e2, 0x72be5d74f27b896f, 0x80deb1fe3b1696b1, 0x9bdc06a725c71235, 
-    0xc19bf174cf692694, 0xe49b69c19ef14ad2, 0xefbe4786384f25e3, 0x0fc19dc68b8cd5b5, 0x240ca1cc77ac9c65, 
-    0x2de92c6f592b0275, 0x4a7484aa6ea6e483, 0x5cb0a9dcbd41fbd4, 0x76f988da831153b5, 0x983e5152ee66dfab, 
-    0xa831c66d2db43210, 0xb00327c898fb213f, 0xbf597fc7beef0ee4, 0xc6e00bf33da88fc2, 0xd5a79147930aa725, 
-    0x06ca6351e003826f, 0x142929670a0e6e70, 0x27b70a8546d22ffc, 0x2e1b21385c26c926, 0x4d2c6dfc5ac42aed, 
-    0x53380d139d95b3df, 0x650a73548baf63de, 0x766a0abb3c77b2a8, 0x81c2c92e47edaee6, 0x92722c851482353b, 
-    0xa2bfe8a14cf10364, 0xa81a664bbc423001, 0xc24b8b70d0f89791, 0xc76c51a30654be30, 0xd192e819d6ef5218, 
-    0xd69906245565a910, 0xf40e35855771202a, 0x106aa07032bbd1b8, 0x19a4c116b8d2d0c8, 0x1e376c085141ab53, 
-    0x2748774cdf8eeb99, 0x34b0bcb5e19b48a8, 0x391c0cb3c5c95a63, 0x4ed8aa4ae3418acb, 0x5b9cca4f7763e373, 
-    0x682e6ff3d6b2b8a3, 0x748f82ee5defb2fc, 0x78a5636f43172f60, 0x84c87814a1f0ab72, 0x8cc702081a6439ec, 
-    0x90befffa23631e28, 0xa4506cebde82bde9, 0xbef9a3f7b2c67915, 0xc67178f2e372532b, 0xca273eceea26619c, 
-    0xd186b8c721c0c207, 0xeada7dd6cde0eb1e, 0xf57d4f7fee6ed178, 0x06f067aa72176fba, 0x0a637dc5a2c898a6, 
-    0x113f9804bef90dae, 0x1b710b35131c471b, 0x28db77f523047d84, 0x32caab7b40c72493, 0x3c9ebe0a15c9bebc, 
-    0x431d67c49c100d4c, 0x4cc5d4becb3e42b6, 0x597f299cfc657e2a, 0x5fcb6fab3ad6faec, 0x6c44198c4a475817
-};
-
-constexpr std::array<size_t, 12> ShiftConstants32 = { 7, 18, 3, 17, 19, 10, 6, 11, 25, 2, 13, 22 };
-constexpr std::array<size_t, 12> ShiftConstants64 = { 1, 8, 7, 19, 61, 6, 14, 18, 41, 28, 34, 39 };
-constexpr std::array<uint32_t, 8> InitialSHA224Hash = { 0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939, 0xffc00b31, 0x68581511, 0x64f98fa7, 0xbefa4fa4 };
-constexpr std::array<uint32_t, 8> InitialSHA256Hash = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
-constexpr std::array<uint64_t, 8> InitialSHA314Hash = { 0xcbbb9d5dc1059ed8, 0x629a292a367cd507, 0x9159015a3070dd17, 0x152fecd8f70e5939, 0x67332667ffc00b31, 0x8eb44a8768581511, 0xdb0c2e0d64f98fa7, 0x47b5481dbefa4fa4 };
-constexpr std::array<uint64_t, 8> InitialSHA512Hash = { 0x6a09e667f3bcc908, 0xbb67ae8584caa73b, 0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1, 0x510e527fade682d1, 0x9b05688c2b3e6c1f, 0x1f83d9abfb41bd6b, 0x5be0cd19137e2179 };
+// The digest as bytes in the order the standard prints them, with each word big-endian.
+template<typename RegisterType, size_t DigestSize>
+std::array<uint8_t, DigestSize * sizeof(RegisterType)> digestBytes(const std::array<RegisterType, DigestSize>& digest)
+{
+    std::array<uint8_t, DigestSize * sizeof(RegisterType)> bytes;
+    for (size_t i = 0; i < DigestSize; ++i) {
+        for (size_t j = 0; j < sizeof(RegisterType); ++j)
+            bytes[i * sizeof(RegisterType) + j] = static_cast<uint8_t>(digest[i] >> (8 * (sizeof(RegisterType) - 1 - j)));
+    }
+    return bytes;
+}
 
 using SHA224 = SHA2<uint32_t, 7, InitialSHA224Hash, 64, RoundConstants32, ShiftConstants32>;
 using SHA256 = SHA2<uint32_t, 8, InitialSHA256Hash, 64, RoundConstants32, ShiftConstants32>;
@@ -0,0 +1,285 @@
+#include "SHA256Generator.h"
+#include "CPUFeatures.h"
+
+namespace Compiler {
+
+#ifdef _M_X64
+
+// These are RoundConstants32 from SHA2.h, which needs a newer compiler than this project.
+static const uint32_t roundConstants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// The arguments arrive in different registers in the Windows and System V calling conventions.
+#ifdef _WIN32
+static const IntRegister stateArgument = ecx;
+static const IntRegister blocksArgument = edx;
+static const IntRegister countArgument = r8;
+#else
+static const IntRegister stateArgument = edi;
+static const IntRegister blocksArgument = esi;
+static const IntRegister countArgument = edx;
+#endif
+
+// The scalar kernel keeps the working variables in eight registers and the message schedule window on the stack.
+static const IntRegister state = r12;
+static const IntRegister blocks = r13;
+static const IntRegister count = r14;
+static const IntRegister temporary0 = r10;
+static const IntRegister temporary1 = r11;
+static const IntRegister temporary2 = ebp;
+static const IntRegister workingVariables[8] = { eax, ebx, ecx, edx, esi, edi, r8, r9 };
+static const IntRegister calleeSavedRegisters[] = { ebx, ebp, esi, edi, r12, r13, r14, r15 };
+static const int32_t scheduleSize = 16 * sizeof(uint32_t);
+static const int32_t blockSize = 64;
+
+SHA256Generator::SHA256Generator()
+	: assembler(buffer)
+{
+	generate(hostKernel());
+}
+
+SHA256Generator::SHA256Generator(Kernel kernel)
+	: assembler(buffer)
+{
+	generate(kernel);
+}
+
+SHA256Generator::Kernel SHA256Generator::hostKernel()
+{
+	const SHA2::CPUFeatures& features = SHA2::CPUFeatures::host();
+	if (features.sha)
+		return SHAExtensions;
+	if (features.bmi2)
+		return ScalarBMI2;
+	return Scalar;
+}
+
+void SHA256Generator::generate(Kernel kernel)
+{
+	generatedKernel = kernel;
+	buffer.clear();
+	if (kernel == SHAExtensions)
+		generateSHAExtensions();
+	else
+		generateScalar(kernel == ScalarBMI2);
+}
+
+void SHA256Generator::generateScalar(bool useBMI2)
+{
+	for (IntRegister reg : calleeSavedRegisters)
+		assembler.push(reg);
+	assembler.sub(esp, ImmediateValue32(scheduleSize));
+	assembler.mov(state, stateArgument);
+	assembler.mov(blocks, blocksArgument);
+	assembler.mov(count, countArgument);
+
+	// The count is checked at the bottom of the loop, which is where the first jump goes.
+	const Assembler::JumpDistanceLocation jumpToCheck = assembler.jmp(Always, 0);
+	const uint32_t loopStart = buffer.size();
+	for (uint32_t i = 0; i < 8; ++i)
+		assembler.mov(workingVariables[i], state, i * sizeof(uint32_t), false);
+
+	for (uint32_t round = 0; round < 64; ++round) {
+		emitScalarSchedule(round);
+		// Each round makes h the new a and d the new e, so the roles move one register to the right.
+		IntRegister v[8];
+		for (uint32_t i = 0; i < 8; ++i)
+			v[i] = workingVariables[(i - round) % 8];
+		emitScalarRound(v, round, useBMI2);
+	}
+
+	for (uint32_t i = 0; i < 8; ++i) {
+		assembler.add(workingVariables[i], state, i * sizeof(uint32_t));
+		assembler.mov(state, i * sizeof(uint32_t), workingVariables[i], false);
+	}
+	assembler.lea(blocks, blocks, blockSize);
+	assembler.setJumpDistance(jumpToCheck, buffer.size() - (jumpToCheck + sizeof(int32_t)));
+	assembler.sub(count, ImmediateValue32(1), true);
+	assembler.jmp(AboveOrEqual, static_cast<int32_t>(loopStart) - static_cast<int32_t>(buffer.size() + Assembler::jmpOperationSize(AboveOrEqual)));
+
+	assembler.add(esp, ImmediateValue32(scheduleSize));
+	for (int32_t i = sizeof(calleeSavedRegisters) / sizeof(calleeSavedRegisters[0]) - 1; i >= 0; --i)
+		assembler.pop(calleeSavedRegisters[i]);
+	assembler.ret();
+}
+
+// Leaves word round of the message schedule in temporary0 and in its place in the window on the stack.
+void SHA256Generator::emitScalarSchedule(uint32_t round)
+{
+	const int32_t slot = (round % 16) * sizeof(uint32_t);
+	if (round < 16) {
+		assembler.mov(temporary0, blocks, round * sizeof(uint32_t), false);
+		assembler.bswap(temporary0);
+		assembler.mov(esp, slot, temporary0, false);
+		return;
+	}
+
+	// w[round] = w[round - 16] + sigma0(w[round - 15]) + w[round - 7] + sigma1(w[round - 2])
+	assembler.mov(temporary0, esp, ((round - 15) % 16) * sizeof(uint32_t), false);
+	assembler.mov(temporary1, temporary0);
+	assembler.ror(temporary1, 18 - 7);
+	assembler.xor(temporary1, temporary0);
+	assembler.ror(temporary1, 7);
+	assembler.shr(temporary0, 3);
+	assembler.xor(temporary0, temporary1);
+	assembler.add(temporary0, esp, slot);
+	assembler.add(temporary0, esp, ((round - 7) % 16) * sizeof(uint32_t));
+
+	assembler.mov(temporary1, esp, ((round - 2) % 16) * sizeof(uint32_t), false);
+	assembler.mov(temporary2, temporary1);
+	assembler.ror(temporary2, 19 - 17);
+	assembler.xor(temporary2, temporary1);
+	assembler.ror(temporary2, 17);
+	assembler.shr(temporary1, 10);
+	assembler.xor(temporary1, temporary2);
+	assembler.add(temporary0, temporary1);
+	assembler.mov(esp, slot, temporary0, false);
+}
+
+void SHA256Generator::emitScalarRound(const IntRegister (&v)[8], uint32_t round, bool useBMI2)
+{
+	const IntRegister a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+	static const uint8_t sigma0Rotations[3] = { 2, 13, 22 };
+	static const uint8_t sigma1Rotations[3] = { 6, 11, 25 };
+
+	// h += w + k + Sigma1(e) + Ch(e, f, g)
+	assembler.add(h, temporary0);
+	assembler.add(h, ImmediateValue32(roundConstants[round]), false);
+	emitRotations(temporary0, e, sigma1Rotations, useBMI2);
+	assembler.add(h, temporary0);
+	assembler.mov(temporary0, f);
+	assembler.xor(temporary0, g);
+	assembler.and(temporary0, e);
+	assembler.xor(temporary0, g);
+	assembler.add(h, temporary0);
+
+	// d += h, then h += Sigma0(a) + Maj(a, b, c)
+	assembler.add(d, h);
+	emitRotations(temporary0, a, sigma0Rotations, useBMI2);
+	assembler.add(h, temporary0);
+	assembler.mov(temporary0, a);
+	assembler.xor(temporary0, b);
+	assembler.mov(temporary1, b);
+	assembler.xor(temporary1, c);
+	assembler.and(temporary0, temporary1);
+	assembler.xor(temporary0, b);
+	assembler.add(h, temporary0);
+}
+
+// destination = (source >>> bits[0]) ^ (source >>> bits[1]) ^ (source >>> bits[2])
+void SHA256Generator::emitRotations(IntRegister destination, IntRegister source, const uint8_t (&bits)[3], bool useBMI2)
+{
+	if (useBMI2) {
+		assembler.rorx(destination, source, bits[0]);
+		assembler.rorx(temporary1, source, bits[1]);
+		assembler.xor(destination, temporary1);
+		assembler.rorx(temporary1, source, bits[2]);
+		assembler.xor(destination, temporary1);
+		return;
+	}
+	// Rotating the partial result keeps this to one register: ((s >>> 14 ^ s) >>> 5 ^ s) >>> 6 for Sigma1.
+	assembler.mov(destination, source);
+	assembler.ror(destination, bits[2] - bits[1]);
+	assembler.xor(destination, source);
+	assembler.ror(destination, bits[1] - bits[0]);
+	assembler.xor(destination, source);
+	assembler.ror(destination, bits[0]);
+}
+
+void SHA256Generator::generateSHAExtensions()
+{
+	// sha256rnds2 reads the message words plus constants from xmm0.
+	const DoubleRegister wk = xmm0;
+	const DoubleRegister abef = xmm1;
+	const DoubleRegister cdgh = xmm2;
+	const DoubleRegister w[4] = { xmm3, xmm4, xmm5, xmm6 };
+	const DoubleRegister byteSwap = xmm7;
+	const DoubleRegister previousABEF = xmm8;
+	const DoubleRegister previousCDGH = xmm9;
+	const DoubleRegister temporary = xmm10;
+	const IntRegister immediate = eax;
+
+#ifdef _WIN32
+	// xmm6 through xmm15 are callee saved on Windows.
+	const int32_t savedSize = 5 * 16;
+	assembler.sub(esp, ImmediateValue32(savedSize));
+	for (int32_t i = 0; i < 5; ++i)
+		assembler.movdqu(esp, i * 16, static_cast<DoubleRegister>(xmm6 + i));
+#endif
+
+	// Constants are built from two 64-bit immediate values instead of loaded from memory.
+	auto loadConstant = [&](DoubleRegister destination, uint64_t low, uint64_t high) {
+		assembler.mov(immediate, ImmediateValue64(low));
+		assembler.movq(destination, immediate);
+		assembler.mov(immediate, ImmediateValue64(high));
+		assembler.pinsrq(destination, immediate, 1);
+	};
+	loadConstant(byteSwap, 0x0405060700010203ull, 0x0c0d0e0f08090a0bull);
+
+	// sha256rnds2 wants the state as ABEF and CDGH instead of ABCD and EFGH.
+	assembler.movdqu(abef, stateArgument, 0);
+	assembler.movdqu(cdgh, stateArgument, 16);
+	assembler.pshufd(abef, abef, 0xB1); // CDAB
+	assembler.pshufd(cdgh, cdgh, 0x1B); // EFGH
+	assembler.movdqa(temporary, abef);
+	assembler.palignr(abef, cdgh, 8);
+	assembler.pblendw(cdgh, temporary, 0xF0);
+
+	const Assembler::JumpDistanceLocation jumpToCheck = assembler.jmp(Always, 0);
+	const uint32_t loopStart = buffer.size();
+	assembler.movdqa(previousABEF, abef);
+	assembler.movdqa(previousCDGH, cdgh);
+	for (int32_t i = 0; i < 4; ++i) {
+		assembler.movdqu(w[i], blocksArgument, 16 * i);
+		assembler.pshufb(w[i], byteSwap);
+	}
+	for (uint32_t i = 0; i < 16; ++i) {
+		// w[i % 4] holds words 4i-16 to 4i-13 here, and the other three hold the twelve words after them.
+		if (i >= 4) {
+			assembler.movdqa(temporary, w[(i + 3) % 4]);
+			assembler.palignr(temporary, w[(i + 2) % 4], 4);
+			assembler.sha256msg1(w[i % 4], w[(i + 1) % 4]);
+			assembler.paddd(w[i % 4], temporary);
+			assembler.sha256msg2(w[i % 4], w[(i + 3) % 4]);
+		}
+		const uint32_t* k = roundConstants + 4 * i;
+		loadConstant(wk, (static_cast<uint64_t>(k[1]) << 32) | k[0], (static_cast<uint64_t>(k[3]) << 32) | k[2]);
+		assembler.paddd(wk, w[i % 4]);
+		assembler.sha256rnds2(cdgh, abef);
+		assembler.pshufd(wk, wk, 0x0E);
+		assembler.sha256rnds2(abef, cdgh);
+	}
+	assembler.paddd(abef, previousABEF);
+	assembler.paddd(cdgh, previousCDGH);
+	assembler.lea(blocksArgument, blocksArgument, blockSize);
+	assembler.setJumpDistance(jumpToCheck, buffer.size() - (jumpToCheck + sizeof(int32_t)));
+	assembler.sub(countArgument, ImmediateValue32(1), true);
+	assembler.jmp(AboveOrEqual, static_cast<int32_t>(loopStart) - static_cast<int32_t>(buffer.size() + Assembler::jmpOperationSize(AboveOrEqual)));
+
+	assembler.pshufd(abef, abef, 0x1B); // FEBA
+	assembler.pshufd(cdgh, cdgh, 0xB1); // DCHG
+	assembler.movdqa(temporary, abef);
+	assembler.pblendw(temporary, cdgh, 0xF0);
+	assembler.movdqu(stateArgument, 0, temporary);
+	assembler.palignr(cdgh, abef, 8);
+	assembler.movdqu(stateArgument, 16, cdgh);
+
+#ifdef _WIN32
+	for (int32_t i = 0; i < 5; ++i)
+		assembler.movdqu(static_cast<DoubleRegister>(xmm6 + i), esp, i * 16);
+	assembler.add(esp, ImmediateValue32(savedSize));
+#endif
+	assembler.ret();
+}
+
+#endif
+
+} // namespace Compiler
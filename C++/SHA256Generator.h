@@ -0,0 +1,52 @@
+#ifndef SHA256_GENERATOR_H
+#define SHA256_GENERATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Assembler.h"
+
+namespace Compiler {
+
+#ifdef _M_X64
+
+// This generates a SHA-256 compression function for the processor it runs on.
+// All 64 rounds are unrolled with the round constants as immediate values, and the working
+// variables are renamed between registers instead of moved, so each round is only its arithmetic.
+// The function can be installed with SHA2::customSHA256Compression to replace the compiled kernels.
+class SHA256Generator {
+public:
+	typedef void (*CompressFunction)(uint32_t* state, const uint8_t* blocks, size_t count);
+
+	enum Kernel {
+		Scalar, // general purpose registers only
+		ScalarBMI2, // rorx for the rotations, which leaves the source register intact
+		SHAExtensions, // sha256rnds2, sha256msg1 and sha256msg2
+	};
+
+	SHA256Generator(); // the best kernel the processor supports
+	explicit SHA256Generator(Kernel);
+
+	CompressFunction compressFunction() { return reinterpret_cast<CompressFunction>(buffer.getExecutableAddress()); }
+	Kernel kernel() { return generatedKernel; }
+	static Kernel hostKernel();
+
+	static void runSHA256GeneratorUnitTests();
+
+private:
+	void generate(Kernel);
+	void generateScalar(bool useBMI2);
+	void generateSHAExtensions();
+	void emitScalarRound(const IntRegister (&v)[8], uint32_t round, bool useBMI2);
+	void emitScalarSchedule(uint32_t round);
+	void emitRotations(IntRegister destination, IntRegister source, const uint8_t (&bits)[3], bool useBMI2);
+
+	AssemblerBuffer buffer;
+	Assembler assembler;
+	Kernel generatedKernel;
+};
+
+#endif
+
+} // namespace Compiler
+
+#endif
@@ -0,0 +1,122 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include "SHA2.h"
+#include <tuple>
+#include <vector>
+
+namespace SHA2 {
+
+// Saves the midstate of a long hash as a small versioned blob so that an interrupted job can
+// resume where its last checkpoint left off instead of from the first byte:
+//
+//     checkpoint = Checkpoint<SHA256>::serialize(hash.midstate());
+//     ...
+//     SHA256::Midstate midstate;
+//     if (Checkpoint<SHA256>::deserialize(checkpoint.data(), checkpoint.size(), midstate)) {
+//         SHA256 hash(midstate);
+//         // continue reading the input at offset midstate.length
+//     }
+//
+// The blob holds a magic number, the format version, the register and digest sizes that tell
+// the SHA-2 variants apart, the message length, the state words and only the buffered tail of
+// the last partial block, all big-endian. It ends with the first word of the SHA-256 of the
+// rest, so a torn or corrupted checkpoint is rejected rather than silently producing a wrong
+// digest. A SHA-512 checkpoint is at most 211 bytes.
+template<typename Hash>
+class Checkpoint {
+public:
+    using Midstate = typename Hash::Midstate;
+    using Register = typename Hash::Register;
+
+    static const uint8_t Version = 1;
+    static const size_t HeaderSize = 16 + 8 * sizeof(Register);
+    static const size_t CheckSize = sizeof(uint32_t);
+    static const size_t MaximumSize = HeaderSize + Hash::BlockSizeBytes - 1 + CheckSize;
+
+    static std::vector<uint8_t> serialize(const Midstate& midstate)
+    {
+        assert(midstate.bufferContents < Hash::BlockSizeBytes);
+        std::vector<uint8_t> bytes(HeaderSize + midstate.bufferContents + CheckSize);
+        uint8_t* out = bytes.data();
+        memcpy(out, magic(), 4);
+        out[4] = Version;
+        out[5] = sizeof(Register);
+        out[6] = DigestWords;
+        out[7] = static_cast<uint8_t>(midstate.bufferContents);
+        storeBigEndian<uint64_t>(out + 8, midstate.length);
+        out += 16;
+        for (Register word : midstate.state) {
+            storeBigEndian(out, word);
+            out += sizeof(word);
+        }
+        memcpy(out, midstate.buffer, midstate.bufferContents);
+        out += midstate.bufferContents;
+        storeBigEndian<uint32_t>(out, check(bytes.data(), out - bytes.data()));
+        return bytes;
+    }
+
+    // Returns false and leaves the midstate unchanged if the bytes are not an intact checkpoint
+    // of this Hash in a version this code reads.
+    static bool deserialize(const uint8_t* bytes, size_t length, Midstate& midstate)
+    {
+        if (length < HeaderSize + CheckSize || memcmp(bytes, magic(), 4) || bytes[4] != Version
+            || bytes[5] != sizeof(Register) || bytes[6] != DigestWords)
+            return false;
+        const size_t bufferContents = bytes[7];
+        const uint64_t messageLength = loadBigEndian<uint64_t>(bytes + 8);
+        if (bufferContents != messageLength % Hash::BlockSizeBytes || length != HeaderSize + bufferContents + CheckSize
+            || loadBigEndian<uint32_t>(bytes + length - CheckSize) != check(bytes, length - CheckSize))
+            return false;
+
+        Midstate result;
+        result.length = messageLength;
+        result.bufferContents = bufferContents;
+        const uint8_t* in = bytes + 16;
+        for (Register& word : result.state) {
+            word = loadBigEndian<Register>(in);
+            in += sizeof(word);
+        }
+        memcpy(result.buffer, in, bufferContents);
+        memset(result.buffer + bufferContents, 0, Hash::BlockSizeBytes - bufferContents);
+        midstate = result;
+        return true;
+    }
+
+private:
+    static const uint8_t DigestWords = std::tuple_size<typename Hash::Digest>::value;
+
+    static const char* magic() { return "SHA2"; }
+
+    static uint32_t check(const uint8_t* bytes, size_t length) { return SHA256::digest(bytes, length)[0]; }
+};
+
+}
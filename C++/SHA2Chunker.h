@@ -0,0 +1,213 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include "SHA2.h"
+#include <functional>
+#include <vector>
+
+namespace SHA2 {
+
+// The 256 random words of the Gear rolling hash. Any fixed table works as long as both
+// sides of a deduplication use the same one, so it is generated by splitmix64 at compile time.
+struct GearTable {
+    uint64_t values[256];
+
+    constexpr GearTable()
+        : values()
+    {
+        uint64_t seed = 0;
+        for (size_t i = 0; i < 256; ++i) {
+            seed += 0x9E3779B97F4A7C15ull;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            values[i] = z ^ (z >> 31);
+        }
+    }
+
+    static const uint64_t* table()
+    {
+        static constexpr GearTable gear;
+        return gear.values;
+    }
+};
+
+// Content-defined chunking, so inserting or removing bytes only changes the chunks near the edit.
+//
+// Boundaries are found with the FastCDC rolling hash fingerprint = (fingerprint << 1) + Gear[byte],
+// whose top bits depend on the last 64 bytes. No boundary is considered in the first minimum
+// bytes of a chunk, a cut is forced at the maximum, and in between the normalized chunking of
+// FastCDC is used: a mask with two more bits than log2(average) before the average size and
+// two fewer after it, which narrows the spread of chunk sizes around the average.
+//
+// Each chunk is hashed as it is scanned, from the caller's buffer, and reported with its
+// offset in the stream; input can be added in any pieces and gives the same chunks.
+template<typename Hash>
+class ContentDefinedChunker {
+public:
+    using Digest = typename Hash::Digest;
+
+    struct Parameters {
+        size_t minimumSize;
+        size_t averageSize;
+        size_t maximumSize;
+    };
+    static constexpr Parameters DefaultParameters { 2 * 1024, 8 * 1024, 64 * 1024 };
+
+    struct Chunk {
+        uint64_t offset;
+        size_t length;
+        Digest digest;
+    };
+    using Callback = std::function<void(const Chunk&)>;
+
+    explicit ContentDefinedChunker(Callback callback, const Parameters& parameters = DefaultParameters)
+        : callback(std::move(callback))
+        , parameters(parameters)
+    {
+        assert(parameters.minimumSize && parameters.minimumSize <= parameters.averageSize);
+        assert(parameters.averageSize <= parameters.maximumSize);
+        size_t bits = 0;
+        while ((size_t(2) << bits) <= parameters.averageSize)
+            ++bits;
+        smallMask = topBits(bits + 2);
+        largeMask = topBits(bits > 2 ? bits - 2 : 1);
+    }
+
+    void addBytes(const void* input, size_t length)
+    {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(input);
+        while (length) {
+            bool boundary;
+            const size_t scanned = findBoundary(bytes, length, boundary);
+            hash.addBytes(bytes, scanned);
+            chunkLength += scanned;
+            bytes += scanned;
+            length -= scanned;
+            if (boundary)
+                endChunk();
+        }
+    }
+
+    // Reports the last chunk, which may be shorter than the minimum. An empty stream has no chunks.
+    void finish()
+    {
+        if (chunkLength)
+            endChunk();
+    }
+
+    static std::vector<Chunk> chunks(const void* input, size_t length, const Parameters& parameters = DefaultParameters)
+    {
+        std::vector<Chunk> result;
+        ContentDefinedChunker chunker([&](const Chunk& chunk) { result.push_back(chunk); }, parameters);
+        chunker.addBytes(input, length);
+        chunker.finish();
+        return result;
+    }
+
+private:
+    static uint64_t topBits(size_t count)
+    {
+        return count >= 64 ? ~uint64_t(0) : ~(~uint64_t(0) >> count);
+    }
+
+    // Rolls the fingerprint over bytes[i] up to bytes[end] and stops after a byte where none of the mask bits are set.
+    // Two bytes are taken per step so the dependency chain is one shift and one add per pair rather than per byte;
+    // the fingerprint after the first byte of the pair is only needed for the boundary test.
+    static bool scan(const uint8_t* bytes, size_t& i, size_t end, uint64_t mask, uint64_t& print)
+    {
+        const uint64_t* gear = GearTable::table();
+        for (; i + 1 < end; i += 2) {
+            const uint64_t first = gear[bytes[i]];
+            const uint64_t second = gear[bytes[i + 1]];
+            const uint64_t middle = (print << 1) + first;
+            print = (print << 2) + (first << 1) + second;
+            if (!(middle & mask)) {
+                print = middle;
+                i += 1;
+                return true;
+            }
+            if (!(print & mask)) {
+                i += 2;
+                return true;
+            }
+        }
+        if (i < end) {
+            print = (print << 1) + gear[bytes[i++]];
+            if (!(print & mask))
+                return true;
+        }
+        return false;
+    }
+
+    // Returns how many bytes belong to the current chunk, and whether the chunk ends there.
+    size_t findBoundary(const uint8_t* bytes, size_t length, bool& boundary)
+    {
+        const size_t position = chunkLength;
+        size_t i = 0;
+        if (position < parameters.minimumSize)
+            i = std::min(parameters.minimumSize - position, length);
+
+        const size_t normalEnd = position < parameters.averageSize ? std::min(parameters.averageSize - position, length) : 0;
+        const size_t maximumEnd = std::min(parameters.maximumSize - position, length);
+        uint64_t print = fingerprint;
+        boundary = true;
+        if (scan(bytes, i, normalEnd, smallMask, print) || scan(bytes, i, maximumEnd, largeMask, print))
+            return i;
+        fingerprint = print;
+        boundary = position + maximumEnd == parameters.maximumSize;
+        return maximumEnd;
+    }
+
+    void endChunk()
+    {
+        callback({ offset, chunkLength, hash.digest() });
+        offset += chunkLength;
+        chunkLength = 0;
+        fingerprint = 0;
+        hash = Hash();
+    }
+
+    Callback callback;
+    Parameters parameters;
+    uint64_t smallMask;
+    uint64_t largeMask;
+    Hash hash;
+    uint64_t fingerprint { 0 };
+    uint64_t offset { 0 };
+    size_t chunkLength { 0 };
+};
+
+template<typename Hash> constexpr typename ContentDefinedChunker<Hash>::Parameters ContentDefinedChunker<Hash>::DefaultParameters;
+
+using SHA256Chunker = ContentDefinedChunker<SHA256>;
+
+}
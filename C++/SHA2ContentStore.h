@@ -0,0 +1,280 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include "MappedFile.h"
+#include "SHA2.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace SHA2 {
+
+// Blobs stored under their SHA-256 digests, in two files next to each other:
+//     path.data   the blobs, appended one after another
+//     path.index  a header and an open-addressing table of (digest, offset, length) slots
+// The index is used where it is mapped, so opening a store costs one mmap however many blobs it holds.
+// Digests are already uniformly distributed, so the first 64 bits of a digest pick its slot directly,
+// and collisions probe the following slots. The table doubles when it gets half full.
+//
+// One thread may add blobs while any number of threads read, in this process or, through
+// their own read-only ContentStore, in others. A blob is written to the data file before its
+// slot is published, and a slot is published by storing its length last with release order,
+// so a reader that finds a slot can read the blob. When the table doubles, the bigger index
+// replaces the file by renaming and the old one is marked superseded; readers in other
+// processes keep using the old table, which is missing only the newer blobs, until refresh.
+// The index is in the byte order of the machine that wrote it.
+class ContentStore {
+public:
+    using Digest = SHA256::Digest;
+
+    ContentStore() = default;
+    ContentStore(const ContentStore&) = delete;
+    ContentStore& operator=(const ContentStore&) = delete;
+
+    // A writable store is created if it does not exist. Only one writer may have a store open, so opening
+    // for writing fails while another ContentStore, in this process or another, has it open for writing.
+    // An index that exists but can't be used is an error and is left as it is.
+    bool open(const char* path, bool writable)
+    {
+        indexPath = std::string(path) + ".index";
+        this->writable = writable;
+        if (!data.open((std::string(path) + ".data").c_str(), writable) || (writable && !data.lockExclusively()) || !data.fileSize(dataSize))
+            return false;
+        auto index = std::make_shared<Index>();
+        if (!index->open(indexPath.c_str(), writable)) {
+            if (!writable || fileExists(indexPath.c_str()) || !index->create(indexPath.c_str(), InitialSlotBits))
+                return false;
+        }
+        std::atomic_store(&current, std::shared_ptr<const Index>(std::move(index)));
+        return true;
+    }
+
+    // Hashes and stores a blob unless a blob with its digest is already stored. Writer only.
+    bool put(const void* bytes, size_t length, Digest& digest)
+    {
+        assert(writable);
+        digest = SHA256::digest(bytes, length);
+        const auto key = digestBytes(digest);
+        std::shared_ptr<const Index> index = std::atomic_load(&current);
+        if (index->find(key.data()))
+            return true;
+        if (2 * (index->header().count.load(std::memory_order_relaxed) + 1) > index->slotCount()) {
+            index = grow(*index);
+            if (!index)
+                return false;
+        }
+        if (length && !data.write(dataSize, bytes, length))
+            return false;
+        index->insert(key.data(), dataSize, length);
+        dataSize += length;
+        return true;
+    }
+
+    bool contains(const Digest& digest) const
+    {
+        const auto key = digestBytes(digest);
+        return std::atomic_load(&current)->find(key.data());
+    }
+
+    // Returns false if no blob has the digest or it cannot be read. The slot is checked against the
+    // data file and the bytes against the digest, so a corrupt store never returns the wrong bytes.
+    bool get(const Digest& digest, std::vector<uint8_t>& bytes) const
+    {
+        const auto key = digestBytes(digest);
+        const std::shared_ptr<const Index> index = std::atomic_load(&current);
+        const Slot* slot = index->find(key.data());
+        if (!slot)
+            return false;
+        const uint64_t length = slot->published.load(std::memory_order_acquire) - 1;
+        const uint64_t offset = slot->offset;
+        // The writer appends while readers look, so the size is read now instead of when the store was opened.
+        uint64_t dataFileSize;
+        if (!data.fileSize(dataFileSize) || offset > dataFileSize || length > dataFileSize - offset)
+            return false;
+        bytes.resize(static_cast<size_t>(length));
+        if (length && !data.read(offset, bytes.data(), bytes.size()))
+            return false;
+        return SHA256::digest(bytes.data(), bytes.size()) == digest;
+    }
+
+    size_t size() const { return static_cast<size_t>(std::atomic_load(&current)->header().count.load(std::memory_order_acquire)); }
+
+    // Picks up a bigger index that another process's writer put in place. Returns false if none could be opened.
+    bool refresh()
+    {
+        if (!std::atomic_load(&current)->header().superseded.load(std::memory_order_acquire))
+            return true;
+        auto index = std::make_shared<Index>();
+        if (!index->open(indexPath.c_str(), writable))
+            return false;
+        std::atomic_store(&current, std::shared_ptr<const Index>(std::move(index)));
+        return true;
+    }
+
+    // Waits until everything stored so far is on the disk. Writer only.
+    bool flush()
+    {
+        return data.sync() && std::atomic_load(&current)->file.flush();
+    }
+
+private:
+    static const uint32_t Version = 1;
+    static const uint32_t InitialSlotBits = 10;
+    static const char* magic() { return "SHA2CAS"; }
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t slotBits;
+        std::atomic<uint64_t> count;
+        std::atomic<uint32_t> superseded;
+        uint8_t reserved[36];
+    };
+
+    struct Slot {
+        uint8_t digest[32];
+        uint64_t offset;
+        // The blob length plus one once the slot is filled, zero while it is empty.
+        std::atomic<uint64_t> published;
+    };
+
+    static_assert(sizeof(Header) == 64 && sizeof(Slot) == 48, "the index layout is part of the file format");
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "slots are published with lock-free atomics in shared memory");
+
+    struct Index {
+        SharedMappedFile file;
+
+        bool open(const char* path, bool writable)
+        {
+            if (!file.open(path, writable) || file.fileSize() < sizeof(Header))
+                return false;
+            const Header& h = header();
+            return !memcmp(h.magic, magic(), sizeof(h.magic)) && h.version == Version && h.slotBits < 48
+                && file.fileSize() == sizeof(Header) + (uint64_t(1) << h.slotBits) * sizeof(Slot);
+        }
+
+        bool create(const char* path, uint32_t slotBits)
+        {
+            if (!file.create(path, sizeof(Header) + (uint64_t(1) << slotBits) * sizeof(Slot)))
+                return false;
+            Header& h = header();
+            memcpy(h.magic, magic(), sizeof(h.magic));
+            h.version = Version;
+            h.slotBits = slotBits;
+            return true;
+        }
+
+        Header& header() const { return *reinterpret_cast<Header*>(file.data()); }
+        Slot* slots() const { return reinterpret_cast<Slot*>(file.data() + sizeof(Header)); }
+        size_t slotCount() const { return size_t(1) << header().slotBits; }
+
+        const Slot* find(const uint8_t* key) const
+        {
+            // The table always has an empty slot, but a corrupt file might not, so the probe stops after every slot.
+            const size_t mask = slotCount() - 1;
+            size_t i = firstSlot(key) & mask;
+            for (size_t probes = 0; probes <= mask; ++probes, i = (i + 1) & mask) {
+                const Slot& slot = slots()[i];
+                if (!slot.published.load(std::memory_order_acquire))
+                    return nullptr;
+                if (!memcmp(slot.digest, key, sizeof(slot.digest)))
+                    return &slot;
+            }
+            return nullptr;
+        }
+
+        void insert(const uint8_t* key, uint64_t offset, uint64_t length) const
+        {
+            const size_t mask = slotCount() - 1;
+            size_t i = firstSlot(key) & mask;
+            while (slots()[i].published.load(std::memory_order_relaxed))
+                i = (i + 1) & mask;
+            Slot& slot = slots()[i];
+            memcpy(slot.digest, key, sizeof(slot.digest));
+            slot.offset = offset;
+            slot.published.store(length + 1, std::memory_order_release);
+            header().count.fetch_add(1, std::memory_order_release);
+        }
+
+        static size_t firstSlot(const uint8_t* key) { return static_cast<size_t>(loadBigEndian<uint64_t>(key)); }
+    };
+
+    // Builds a table twice the size next to the index, renames it over the index, and marks the old one superseded.
+    std::shared_ptr<const Index> grow(const Index& old)
+    {
+        const std::string newPath = indexPath + ".new";
+        auto index = std::make_shared<Index>();
+        if (!index->create(newPath.c_str(), old.header().slotBits + 1))
+            return nullptr;
+        for (size_t i = 0; i < old.slotCount(); ++i) {
+            const Slot& slot = old.slots()[i];
+            if (const uint64_t published = slot.published.load(std::memory_order_relaxed))
+                index->insert(slot.digest, slot.offset, published - 1);
+        }
+        if (!replaceFile(newPath.c_str(), indexPath.c_str()))
+            return nullptr;
+        std::shared_ptr<const Index> grown(std::move(index));
+        std::atomic_store(&current, grown);
+        old.header().superseded.store(1, std::memory_order_release);
+        return grown;
+    }
+
+    static bool fileExists(const char* path)
+    {
+#ifdef _WIN32
+        return GetFileAttributesA(path) != INVALID_FILE_ATTRIBUTES || GetLastError() != ERROR_FILE_NOT_FOUND;
+#else
+        struct stat status;
+        return !stat(path, &status) || errno != ENOENT;
+#endif
+    }
+
+    static bool replaceFile(const char* from, const char* to)
+    {
+#ifdef _WIN32
+        return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING);
+#else
+        return !rename(from, to);
+#endif
+    }
+
+    std::string indexPath;
+    bool writable { false };
+    RandomAccessFile data;
+    uint64_t dataSize { 0 };
+    // Readers keep the table they looked up alive while the writer replaces it.
+    std::shared_ptr<const Index> current;
+};
+
+}
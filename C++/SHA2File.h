@@ -0,0 +1,66 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include "MappedFile.h"
+#include "SHA2.h"
+#include <algorithm>
+
+namespace SHA2 {
+
+// Hashes a file by mapping it a window at a time instead of reading it into a buffer.
+// Every window but the last is a whole number of blocks, so addBytes compresses the
+// mapped pages directly and never stages them in its block buffer.
+// Returns false if the file cannot be opened or mapped.
+template<typename Hash>
+bool hashFile(const char* path, typename Hash::Digest& digest, size_t windowSize = 64 * 1024 * 1024)
+{
+    MappedFile file;
+    if (!file.open(path))
+        return false;
+
+    const size_t alignment = std::max(file.granularity(), Hash::BlockSizeBytes);
+    windowSize = std::max(alignment, windowSize / alignment * alignment);
+    const uint64_t size = file.fileSize();
+    Hash hash;
+    for (uint64_t offset = 0; offset < size; offset += windowSize) {
+        const size_t length = static_cast<size_t>(std::min<uint64_t>(windowSize, size - offset));
+        const uint8_t* bytes = file.map(offset, length);
+        if (!bytes)
+            return false;
+        if (offset + length < size)
+            file.prefetch(offset + length, static_cast<size_t>(std::min<uint64_t>(windowSize, size - offset - length)));
+        hash.addBytes(bytes, length);
+    }
+    digest = hash.digest();
+    return true;
+}
+
+}
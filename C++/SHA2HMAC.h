@@ -0,0 +1,277 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include "SHA2.h"
+#include "SHA2MultiBuffer.h"
+#include <type_traits>
+
+namespace SHA2 {
+
+// HMAC (RFC 2104) with the key's padded blocks hashed once, when the key is set.
+// Each message then starts from the inner and outer midstates instead of rehashing
+// a block of ipad and a block of opad.
+template<typename Hash>
+class HMAC {
+public:
+    using Digest = typename Hash::Digest;
+    using Midstate = typename Hash::Midstate;
+    static constexpr size_t DigestSizeBytes = sizeof(Digest);
+
+    HMAC(const void* key, size_t keyLength)
+    {
+        uint8_t block[Hash::BlockSizeBytes] = { };
+        if (keyLength > Hash::BlockSizeBytes) {
+            Hash keyHash;
+            keyHash.addBytes(key, keyLength);
+            const auto digest = digestBytes(keyHash.digest());
+            memcpy(block, digest.data(), digest.size());
+        } else if (keyLength)
+            memcpy(block, key, keyLength);
+
+        for (size_t i = 0; i < Hash::BlockSizeBytes; ++i)
+            block[i] ^= 0x36;
+        Hash inner;
+        inner.addBytes(block, Hash::BlockSizeBytes);
+        innerMidstate = inner.midstate();
+
+        for (size_t i = 0; i < Hash::BlockSizeBytes; ++i)
+            block[i] ^= 0x36 ^ 0x5c;
+        Hash outer;
+        outer.addBytes(block, Hash::BlockSizeBytes);
+        outerMidstate = outer.midstate();
+    }
+
+    Digest digest(const void* message, size_t length) const
+    {
+        const Span segment = { message, length };
+        return digestSegments(&segment, 1);
+    }
+
+    Digest digestSegments(const Span* segments, size_t count) const
+    {
+        Hash inner(innerMidstate);
+        inner.addSegments(segments, count);
+        return finish(inner);
+    }
+
+    // For messages that arrive in pieces: add them to begin() and pass it to finish().
+    Hash begin() const { return Hash(innerMidstate); }
+
+    Digest finish(Hash& inner) const
+    {
+        const auto innerDigest = digestBytes(inner.digest());
+        Hash outer(outerMidstate);
+        outer.addBytes(innerDigest.data(), innerDigest.size());
+        return outer.digest();
+    }
+
+    const Midstate& inner() const { return innerMidstate; }
+    const Midstate& outer() const { return outerMidstate; }
+
+private:
+    Midstate innerMidstate;
+    Midstate outerMidstate;
+};
+
+// HKDF (RFC 5869).
+template<typename Hash>
+struct HKDF {
+    using Digest = typename Hash::Digest;
+    static constexpr size_t DigestSizeBytes = sizeof(Digest);
+
+    // An empty salt means a salt of DigestSizeBytes zeros, which HMAC pads to the same key.
+    static Digest extract(const void* salt, size_t saltLength, const void* inputKey, size_t inputKeyLength)
+    {
+        return HMAC<Hash>(salt, saltLength).digest(inputKey, inputKeyLength);
+    }
+
+    // Returns false if more than 255 digests of output are asked for.
+    static bool expand(const Digest& pseudorandomKey, const void* info, size_t infoLength, uint8_t* output, size_t outputLength)
+    {
+        if (outputLength > 255 * DigestSizeBytes)
+            return false;
+        const auto key = digestBytes(pseudorandomKey);
+        const HMAC<Hash> hmac(key.data(), key.size());
+        std::array<uint8_t, DigestSizeBytes> previous;
+        for (uint8_t counter = 1; outputLength; ++counter) {
+            const Span segments[] = {
+                { previous.data(), counter == 1 ? 0 : previous.size() },
+                { info, infoLength },
+                { &counter, 1 },
+            };
+            previous = digestBytes(hmac.digestSegments(segments, 3));
+            const size_t copied = std::min(outputLength, previous.size());
+            memcpy(output, previous.data(), copied);
+            output += copied;
+            outputLength -= copied;
+        }
+        return true;
+    }
+
+    static bool derive(const void* salt, size_t saltLength, const void* inputKey, size_t inputKeyLength, const void* info, size_t infoLength, uint8_t* output, size_t outputLength)
+    {
+        return expand(extract(salt, saltLength, inputKey, inputKeyLength), info, infoLength, output, outputLength);
+    }
+};
+
+// PBKDF2 (RFC 8018) with HMAC. All iterations after the first hash exactly one digest, so
+// with the pads already hashed each HMAC is two single-block compressions. For SHA-224 and
+// SHA-256 on CPUs with AVX2, up to eight output blocks are computed side by side in the
+// lanes of the multi-buffer kernel.
+template<typename Hash>
+struct PBKDF2 {
+    using Digest = typename Hash::Digest;
+    static constexpr size_t DigestSizeBytes = sizeof(Digest);
+
+    static void derive(const void* password, size_t passwordLength, const void* salt, size_t saltLength, size_t iterations, uint8_t* output, size_t outputLength)
+    {
+        assert(iterations);
+        const HMAC<Hash> hmac(password, passwordLength);
+        uint32_t blockIndex = 1;
+        while (outputLength) {
+            const size_t blocks = std::min((outputLength + DigestSizeBytes - 1) / DigestSizeBytes, MaximumLanes);
+            Digest results[MaximumLanes];
+            if (blocks > 1 && useLanes())
+                deriveLanes<Hash>(hmac, salt, saltLength, iterations, blockIndex, blocks, results);
+            else {
+                for (size_t i = 0; i < blocks; ++i)
+                    results[i] = deriveBlock(hmac, salt, saltLength, iterations, blockIndex + static_cast<uint32_t>(i));
+            }
+            for (size_t i = 0; i < blocks; ++i) {
+                const auto bytes = digestBytes(results[i]);
+                const size_t copied = std::min(outputLength, bytes.size());
+                memcpy(output, bytes.data(), copied);
+                output += copied;
+                outputLength -= copied;
+            }
+            blockIndex += static_cast<uint32_t>(blocks);
+        }
+    }
+
+private:
+    static constexpr bool HasLanes = std::is_same<typename Hash::Register, uint32_t>::value;
+    static constexpr size_t MaximumLanes = 8;
+
+    static bool useLanes()
+    {
+#ifdef SHA2_X86
+        return HasLanes && SHA256AVX2Kernel::isSupported();
+#else
+        return false;
+#endif
+    }
+
+    static Digest firstIteration(const HMAC<Hash>& hmac, const void* salt, size_t saltLength, uint32_t blockIndex)
+    {
+        const uint8_t index[4] = { static_cast<uint8_t>(blockIndex >> 24), static_cast<uint8_t>(blockIndex >> 16), static_cast<uint8_t>(blockIndex >> 8), static_cast<uint8_t>(blockIndex) };
+        const Span segments[] = { { salt, saltLength }, { index, sizeof(index) } };
+        return hmac.digestSegments(segments, 2);
+    }
+
+    static Digest deriveBlock(const HMAC<Hash>& hmac, const void* salt, size_t saltLength, size_t iterations, uint32_t blockIndex)
+    {
+        Digest u = firstIteration(hmac, salt, saltLength, blockIndex);
+        Digest result = u;
+        for (size_t iteration = 1; iteration < iterations; ++iteration) {
+            const auto bytes = digestBytes(u);
+            u = hmac.digest(bytes.data(), bytes.size());
+            for (size_t i = 0; i < result.size(); ++i)
+                result[i] ^= u[i];
+        }
+        return result;
+    }
+
+#ifdef SHA2_X86
+    // Runs the iterations of several output blocks in the lanes of the AVX2 kernel. Both
+    // the inner and the outer hash of each iteration are one block: the digest being hashed,
+    // then padding for a message one block longer than the digest.
+    template<typename Hasher, typename std::enable_if_t<std::is_same<typename Hasher::Register, uint32_t>::value>* = nullptr>
+    static void deriveLanes(const HMAC<Hash>& hmac, const void* salt, size_t saltLength, size_t iterations, uint32_t firstBlockIndex, size_t blocks, Digest* results)
+    {
+        using Kernel = SHA256AVX2Kernel;
+        constexpr size_t Words = std::tuple_size<Digest>::value;
+        alignas(64) uint32_t state[8][Kernel::Lanes];
+        uint8_t laneBlocks[Kernel::Lanes][Hash::BlockSizeBytes] = { };
+        const uint8_t* blockPointers[Kernel::Lanes];
+        for (size_t lane = 0; lane < Kernel::Lanes; ++lane) {
+            uint8_t* block = laneBlocks[lane];
+            block[DigestSizeBytes] = 0x80;
+            const uint64_t bits = (Hash::BlockSizeBytes + DigestSizeBytes) * 8;
+            for (size_t i = 0; i < sizeof(uint64_t); ++i)
+                block[Hash::BlockSizeBytes - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+            blockPointers[lane] = block;
+        }
+
+        // Lanes past the last output block repeat it and are ignored.
+        for (size_t lane = 0; lane < blocks; ++lane) {
+            results[lane] = firstIteration(hmac, salt, saltLength, firstBlockIndex + static_cast<uint32_t>(lane));
+            for (size_t i = 0; i < 8; ++i)
+                state[i][lane] = i < Words ? results[lane][i] : 0;
+        }
+        for (size_t lane = blocks; lane < Kernel::Lanes; ++lane) {
+            for (size_t i = 0; i < 8; ++i)
+                state[i][lane] = state[i][blocks - 1];
+        }
+
+        for (size_t iteration = 1; iteration < iterations; ++iteration) {
+            compressDigests(state, laneBlocks, blockPointers, hmac.inner());
+            compressDigests(state, laneBlocks, blockPointers, hmac.outer());
+            for (size_t lane = 0; lane < blocks; ++lane) {
+                for (size_t i = 0; i < Words; ++i)
+                    results[lane][i] ^= state[i][lane];
+            }
+        }
+    }
+
+    // Replaces the digest in each lane with the hash of that digest continued from midstate.
+    static void compressDigests(uint32_t (&state)[8][SHA256AVX2Kernel::Lanes], uint8_t (&laneBlocks)[SHA256AVX2Kernel::Lanes][Hash::BlockSizeBytes], const uint8_t* const (&blockPointers)[SHA256AVX2Kernel::Lanes], const typename Hash::Midstate& midstate)
+    {
+        constexpr size_t Words = std::tuple_size<Digest>::value;
+        for (size_t lane = 0; lane < SHA256AVX2Kernel::Lanes; ++lane) {
+            for (size_t i = 0; i < Words; ++i)
+                storeBigEndian<uint32_t>(laneBlocks[lane] + 4 * i, state[i][lane]);
+        }
+        for (size_t i = 0; i < 8; ++i) {
+            for (size_t lane = 0; lane < SHA256AVX2Kernel::Lanes; ++lane)
+                state[i][lane] = static_cast<uint32_t>(midstate.state[i]);
+        }
+        SHA256AVX2Kernel::compress(state, blockPointers);
+    }
+
+    template<typename Hasher, typename std::enable_if_t<!std::is_same<typename Hasher::Register, uint32_t>::value>* = nullptr>
+    static void deriveLanes(const HMAC<Hash>&, const void*, size_t, size_t, uint32_t, size_t, Digest*) { }
+#else
+    template<typename Hasher>
+    static void deriveLanes(const HMAC<Hash>&, const void*, size_t, size_t, uint32_t, size_t, Digest*) { }
+#endif
+};
+
+}
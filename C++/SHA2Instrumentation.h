@@ -0,0 +1,307 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include <stdint.h>
+
+// Define SHA2_INSTRUMENTATION before including SHA2.h to count what hashing spends its time on.
+// Without it the hooks in SHA2.h expand to nothing and statistics() always returns zeros.
+#ifdef SHA2_INSTRUMENTATION
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#endif
+
+namespace SHA2 {
+
+// Totals over every thread since the last resetStatistics, including threads that have exited.
+struct Statistics {
+    uint64_t bytes { 0 }; // message bytes given to addBytes and the one-shot digest
+    uint64_t blocks { 0 }; // blocks compressed, including padding blocks
+    uint64_t compressionNanoseconds { 0 };
+    uint64_t stagingNanoseconds { 0 }; // copying partial blocks into the buffer
+    uint64_t cycles { 0 }; // core cycles in compression, from the hardware counters
+    uint64_t instructions { 0 }; // instructions retired in compression, from the hardware counters
+    bool enabled { false }; // whether SHA2_INSTRUMENTATION was defined
+    bool hardwareCounters { false }; // whether every thread that compressed could open the hardware counters
+};
+
+#ifdef SHA2_INSTRUMENTATION
+
+// Each thread adds to counters of its own, so hashing on many threads does not contend.
+// Only the owning thread writes them, so the atomics are plain loads and stores that
+// statistics() can read from any thread.
+//
+// Cycles and instructions come from perf_event_open, counting user space only for the
+// calling thread. Where that is not permitted, such as with a restrictive
+// kernel.perf_event_paranoid or outside Linux, they stay zero and hardwareCounters is false.
+// Reading the counters is a system call on each side of every compression call,
+// so hashing many small messages is noticeably slower while instrumented.
+class Instrumentation {
+public:
+    static Statistics statistics()
+    {
+        Registry& registry = Registry::shared();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        Statistics totals = registry.retired;
+        for (const ThreadCounters* counters : registry.threads)
+            counters->addTo(totals);
+        subtract(totals, registry.baseline);
+        totals.enabled = true;
+        totals.hardwareCounters = registry.openedHardwareCounters && !registry.missingHardwareCounters;
+        return totals;
+    }
+
+    static void resetStatistics()
+    {
+        Statistics current = statistics();
+        Registry& registry = Registry::shared();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        add(registry.baseline, current);
+    }
+
+    static void countBytes(uint64_t bytes) { ThreadCounters::current().add(ThreadCounters::current().bytes, bytes); }
+
+    class CompressionScope;
+    class StagingScope;
+
+private:
+    struct ThreadCounters;
+
+    struct Registry {
+        std::mutex mutex;
+        std::vector<const ThreadCounters*> threads;
+        Statistics retired { }; // from threads that have exited
+        Statistics baseline { }; // subtracted by resetStatistics
+        bool openedHardwareCounters { false };
+        bool missingHardwareCounters { false };
+
+        static Registry& shared()
+        {
+            static Registry registry;
+            return registry;
+        }
+    };
+
+    struct ThreadCounters {
+        std::atomic<uint64_t> bytes { 0 };
+        std::atomic<uint64_t> blocks { 0 };
+        std::atomic<uint64_t> compressionNanoseconds { 0 };
+        std::atomic<uint64_t> stagingNanoseconds { 0 };
+        std::atomic<uint64_t> cycles { 0 };
+        std::atomic<uint64_t> instructions { 0 };
+        int counterGroup { -1 };
+
+        ThreadCounters()
+        {
+            counterGroup = openHardwareCounters();
+            Registry& registry = Registry::shared();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.threads.push_back(this);
+            registry.openedHardwareCounters |= counterGroup >= 0;
+            registry.missingHardwareCounters |= counterGroup < 0;
+        }
+
+        ~ThreadCounters()
+        {
+            Registry& registry = Registry::shared();
+            {
+                std::lock_guard<std::mutex> lock(registry.mutex);
+                addTo(registry.retired);
+                registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+            }
+#if defined(__linux__)
+            if (counterGroup >= 0)
+                close(counterGroup);
+#endif
+        }
+
+        static ThreadCounters& current()
+        {
+            static thread_local ThreadCounters counters;
+            return counters;
+        }
+
+        void add(std::atomic<uint64_t>& counter, uint64_t value)
+        {
+            counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        }
+
+        void addTo(Statistics& totals) const
+        {
+            totals.bytes += bytes.load(std::memory_order_relaxed);
+            totals.blocks += blocks.load(std::memory_order_relaxed);
+            totals.compressionNanoseconds += compressionNanoseconds.load(std::memory_order_relaxed);
+            totals.stagingNanoseconds += stagingNanoseconds.load(std::memory_order_relaxed);
+            totals.cycles += cycles.load(std::memory_order_relaxed);
+            totals.instructions += instructions.load(std::memory_order_relaxed);
+        }
+
+        void readHardwareCounters(uint64_t& cycles, uint64_t& instructions)
+        {
+#if defined(__linux__)
+            // With PERF_FORMAT_GROUP one read returns the number of counters and then each value.
+            uint64_t values[3];
+            if (counterGroup >= 0 && read(counterGroup, values, sizeof(values)) == sizeof(values)) {
+                cycles = values[1];
+                instructions = values[2];
+            }
+#else
+            (void)cycles;
+            (void)instructions;
+#endif
+        }
+
+        // Opens cycles and instructions as one group so a single read returns both. Returns -1 if not permitted.
+        static int openHardwareCounters()
+        {
+#if defined(__linux__)
+            perf_event_attr attributes = { };
+            attributes.size = sizeof(attributes);
+            attributes.type = PERF_TYPE_HARDWARE;
+            attributes.exclude_kernel = 1;
+            attributes.exclude_hv = 1;
+            attributes.read_format = PERF_FORMAT_GROUP;
+            attributes.config = PERF_COUNT_HW_CPU_CYCLES;
+            const int leader = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+            if (leader < 0)
+                return -1;
+            attributes.config = PERF_COUNT_HW_INSTRUCTIONS;
+            const int member = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, leader, 0));
+            if (member < 0) {
+                close(leader);
+                return -1;
+            }
+            // The group leader's descriptor reads the whole group, and closing it later closes the group.
+            return leader;
+#else
+            return -1;
+#endif
+        }
+    };
+
+    static void add(Statistics& totals, const Statistics& more)
+    {
+        totals.bytes += more.bytes;
+        totals.blocks += more.blocks;
+        totals.compressionNanoseconds += more.compressionNanoseconds;
+        totals.stagingNanoseconds += more.stagingNanoseconds;
+        totals.cycles += more.cycles;
+        totals.instructions += more.instructions;
+    }
+
+    static void subtract(Statistics& totals, const Statistics& baseline)
+    {
+        totals.bytes -= baseline.bytes;
+        totals.blocks -= baseline.blocks;
+        totals.compressionNanoseconds -= baseline.compressionNanoseconds;
+        totals.stagingNanoseconds -= baseline.stagingNanoseconds;
+        totals.cycles -= baseline.cycles;
+        totals.instructions -= baseline.instructions;
+    }
+};
+
+// Measures the compression of some blocks for as long as it is in scope.
+class Instrumentation::CompressionScope {
+public:
+    explicit CompressionScope(uint64_t blocks)
+        : counters(ThreadCounters::current())
+        , blocks(blocks)
+    {
+        counters.readHardwareCounters(startCycles, startInstructions);
+        start = std::chrono::steady_clock::now();
+    }
+
+    ~CompressionScope()
+    {
+        const auto end = std::chrono::steady_clock::now();
+        uint64_t cycles = 0, instructions = 0;
+        counters.readHardwareCounters(cycles, instructions);
+        counters.add(counters.blocks, blocks);
+        counters.add(counters.compressionNanoseconds, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        counters.add(counters.cycles, cycles - startCycles);
+        counters.add(counters.instructions, instructions - startInstructions);
+    }
+
+private:
+    ThreadCounters& counters;
+    uint64_t blocks;
+    uint64_t startCycles { 0 };
+    uint64_t startInstructions { 0 };
+    std::chrono::steady_clock::time_point start;
+};
+
+// Measures copying into the staging buffer for as long as it is in scope.
+class Instrumentation::StagingScope {
+public:
+    StagingScope()
+        : counters(ThreadCounters::current())
+        , start(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~StagingScope()
+    {
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        counters.add(counters.stagingNanoseconds, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+private:
+    ThreadCounters& counters;
+    std::chrono::steady_clock::time_point start;
+};
+
+// The hooks name the namespace from the root because inside the SHA2 class template, SHA2 is the class.
+#define SHA2_COUNT_BYTES(bytes) ::SHA2::Instrumentation::countBytes(bytes)
+#define SHA2_MEASURE_COMPRESSION(blocks) ::SHA2::Instrumentation::CompressionScope compressionScope(blocks)
+#define SHA2_MEASURE_STAGING() ::SHA2::Instrumentation::StagingScope stagingScope
+
+inline Statistics statistics() { return Instrumentation::statistics(); }
+inline void resetStatistics() { Instrumentation::resetStatistics(); }
+
+#else
+
+#define SHA2_COUNT_BYTES(bytes)
+#define SHA2_MEASURE_COMPRESSION(blocks)
+#define SHA2_MEASURE_STAGING()
+
+inline Statistics statistics() { return Statistics(); }
+inline void resetStatistics() { }
+
+#endif
+
+}
@@ -0,0 +1,323 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include "MappedFile.h"
+#include "SHA2.h"
+#include "SHA2File.h"
+#include "SHA2MultiBuffer.h"
+#include "ThreadPool.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace SHA2 {
+
+struct ManifestOptions {
+    // Zero means one per hardware thread.
+    size_t threads { 0 };
+    // Files up to this size are hashed in batches, through the multi-buffer lanes where they are faster.
+    uint64_t smallFileSize { 1024 * 1024 };
+    // Files from this size on are hashed as tasks of their own, with windows ahead of the hash
+    // read by other workers so the disk sees several requests at once.
+    uint64_t largeFileSize { 256 * 1024 * 1024 };
+    size_t windowSize { 16 * 1024 * 1024 };
+    size_t windowsAhead { 4 };
+};
+
+// Checks files against a manifest in the format of sha256sum and its siblings: one
+// "<hex digest>  <path>" line per file, with "*" in place of the second space for binary mode.
+// A path with a backslash, newline or carriage return is written escaped as \\, \n or \r, and
+// its line starts with a backslash.
+template<typename Hash>
+class Manifest {
+public:
+    using Digest = typename Hash::Digest;
+
+    struct Entry {
+        std::string path;
+        Digest digest;
+    };
+
+    enum class Status { Match, Mismatch, Unreadable };
+
+    struct Result {
+        const Entry* entry;
+        Status status;
+        uint64_t bytes;
+    };
+
+    struct Summary {
+        size_t files;
+        size_t mismatches;
+        size_t unreadable;
+        uint64_t bytes;
+        double seconds;
+    };
+
+    // Called once per entry, as soon as the entry is checked, from one thread at a time.
+    using Callback = std::function<void(const Result&)>;
+
+    // Returns false with the 1-based number of the first bad line. Empty lines are skipped.
+    static bool parse(const std::string& text, std::vector<Entry>& entries, size_t& errorLine)
+    {
+        const size_t hexLength = 2 * sizeof(Digest);
+        errorLine = 0;
+        for (size_t begin = 0; begin < text.size(); ) {
+            size_t end = text.find('\n', begin);
+            if (end == std::string::npos)
+                end = text.size();
+            ++errorLine;
+            size_t lineEnd = end;
+            if (lineEnd > begin && text[lineEnd - 1] == '\r')
+                --lineEnd;
+            if (lineEnd > begin) {
+                const bool escaped = text[begin] == '\\';
+                const size_t digestBegin = begin + escaped;
+                Entry entry;
+                if (lineEnd - digestBegin < hexLength + 3 || !parseDigest(text.data() + digestBegin, entry.digest)
+                    || text[digestBegin + hexLength] != ' ' || (text[digestBegin + hexLength + 1] != ' ' && text[digestBegin + hexLength + 1] != '*'))
+                    return false;
+                entry.path.assign(text, digestBegin + hexLength + 2, lineEnd - digestBegin - hexLength - 2);
+                if (escaped && !unescapePath(entry.path))
+                    return false;
+                entries.push_back(std::move(entry));
+            }
+            begin = end + 1;
+        }
+        errorLine = 0;
+        return true;
+    }
+
+    // Hashes every entry on a work-stealing pool. Entries are handed out in runs, and each run
+    // batches its small files into the multi-buffer lanes, hashes medium files itself, and posts
+    // large files as tasks of their own for idle workers to steal.
+    static Summary verify(const std::vector<Entry>& entries, const Callback& callback, const ManifestOptions& options = ManifestOptions())
+    {
+        const auto start = std::chrono::steady_clock::now();
+        Verification verification { options, callback, { }, { 0, 0, 0, 0, 0 } };
+        {
+            ThreadPool pool(options.threads);
+            const size_t run = 256;
+            for (size_t begin = 0; begin < entries.size(); begin += run) {
+                const size_t end = std::min(entries.size(), begin + run);
+                pool.post([&, begin, end] { verifyRun(pool, verification, entries.data() + begin, entries.data() + end); });
+            }
+            pool.wait();
+        }
+        verification.summary.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return verification.summary;
+    }
+
+private:
+    static const size_t BatchSize = 16;
+
+    struct Verification {
+        const ManifestOptions& options;
+        const Callback& callback;
+        std::mutex mutex;
+        Summary summary;
+    };
+
+    static int hexValue(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+
+    // Decodes the escapes sha256sum writes in place. Any other use of a backslash is an error.
+    static bool unescapePath(std::string& path)
+    {
+        size_t written = 0;
+        for (size_t i = 0; i < path.size(); ++i) {
+            char c = path[i];
+            if (c == '\\') {
+                if (++i == path.size())
+                    return false;
+                switch (path[i]) {
+                case '\\':
+                    c = '\\';
+                    break;
+                case 'n':
+                    c = '\n';
+                    break;
+                case 'r':
+                    c = '\r';
+                    break;
+                default:
+                    return false;
+                }
+            }
+            path[written++] = c;
+        }
+        path.resize(written);
+        return true;
+    }
+
+    static bool parseDigest(const char* hex, Digest& digest)
+    {
+        for (auto& word : digest) {
+            word = 0;
+            for (size_t i = 0; i < 2 * sizeof(word); ++i) {
+                const int value = hexValue(*hex++);
+                if (value < 0)
+                    return false;
+                word = (word << 4) | static_cast<typename Hash::Register>(value);
+            }
+        }
+        return true;
+    }
+
+    static void report(Verification& verification, const Entry& entry, Status status, uint64_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(verification.mutex);
+        Summary& summary = verification.summary;
+        ++summary.files;
+        summary.bytes += bytes;
+        if (status == Status::Mismatch)
+            ++summary.mismatches;
+        else if (status == Status::Unreadable)
+            ++summary.unreadable;
+        if (verification.callback)
+            verification.callback({ &entry, status, bytes });
+    }
+
+    static void verifyRun(ThreadPool& pool, Verification& verification, const Entry* begin, const Entry* end)
+    {
+        const ManifestOptions& options = verification.options;
+        MappedFile files[BatchSize];
+        Span messages[BatchSize];
+        const Entry* batch[BatchSize];
+        size_t batched = 0;
+        for (const Entry* entry = begin; entry != end; ++entry) {
+            MappedFile& file = files[batched];
+            if (!file.open(entry->path.c_str())) {
+                report(verification, *entry, Status::Unreadable, 0);
+                continue;
+            }
+            const uint64_t size = file.fileSize();
+            if (size <= options.smallFileSize) {
+                const uint8_t* bytes = size ? file.map(0, static_cast<size_t>(size)) : reinterpret_cast<const uint8_t*>("");
+                if (!bytes) {
+                    file.close();
+                    report(verification, *entry, Status::Unreadable, 0);
+                    continue;
+                }
+                messages[batched] = { bytes, static_cast<size_t>(size) };
+                batch[batched++] = entry;
+                if (batched == BatchSize) {
+                    verifyBatch(verification, files, messages, batch, batched);
+                    batched = 0;
+                }
+                continue;
+            }
+            file.close();
+            if (size < options.largeFileSize) {
+                Digest digest;
+                const bool read = hashFile<Hash>(entry->path.c_str(), digest, options.windowSize);
+                report(verification, *entry, !read ? Status::Unreadable : digest == entry->digest ? Status::Match : Status::Mismatch, read ? size : 0);
+            } else
+                pool.post([&pool, &verification, entry] { verifyLargeFile(pool, verification, *entry); });
+        }
+        verifyBatch(verification, files, messages, batch, batched);
+    }
+
+    static void verifyBatch(Verification& verification, MappedFile* files, const Span* messages, const Entry* const* batch, size_t count)
+    {
+        if (!count)
+            return;
+        Digest digests[BatchSize];
+        BatchHash<Hash>::digest(messages, count, digests);
+        for (size_t i = 0; i < count; ++i) {
+            files[i].close();
+            report(verification, *batch[i], digests[i] == batch[i]->digest ? Status::Match : Status::Mismatch, messages[i].length);
+        }
+    }
+
+    // Hashes a large file a window at a time while reader tasks fault in the windows ahead of it.
+    // Readers that start after the hash has passed their window have nothing left to do.
+    static void verifyLargeFile(ThreadPool& pool, Verification& verification, const Entry& entry)
+    {
+        const ManifestOptions& options = verification.options;
+        MappedFile file;
+        if (!file.open(entry.path.c_str())) {
+            report(verification, entry, Status::Unreadable, 0);
+            return;
+        }
+        const size_t alignment = std::max(MappedFile::granularity(), Hash::BlockSizeBytes);
+        const size_t windowSize = std::max(alignment, options.windowSize / alignment * alignment);
+        const uint64_t size = file.fileSize();
+        auto hashed = std::make_shared<std::atomic<uint64_t>>(0);
+        uint64_t readAhead = 0;
+        Hash hash;
+        for (uint64_t offset = 0; offset < size; offset += windowSize) {
+            for (; readAhead < size && readAhead <= offset + options.windowsAhead * windowSize; readAhead += windowSize) {
+                if (readAhead > offset) {
+                    const size_t length = static_cast<size_t>(std::min<uint64_t>(windowSize, size - readAhead));
+                    pool.post([&entry, hashed, readAhead, length] { readWindow(entry, *hashed, readAhead, length); });
+                }
+            }
+            const size_t length = static_cast<size_t>(std::min<uint64_t>(windowSize, size - offset));
+            const uint8_t* bytes = file.map(offset, length);
+            if (!bytes) {
+                report(verification, entry, Status::Unreadable, 0);
+                return;
+            }
+            hash.addBytes(bytes, length);
+            *hashed = offset + length;
+        }
+        report(verification, entry, hash.digest() == entry.digest ? Status::Match : Status::Mismatch, size);
+    }
+
+    static void readWindow(const Entry& entry, const std::atomic<uint64_t>& hashed, uint64_t offset, size_t length)
+    {
+        const size_t pageSize = 4096;
+        MappedFile file;
+        if (hashed > offset || !file.open(entry.path.c_str()))
+            return;
+        const uint8_t* bytes = file.map(offset, length);
+        if (!bytes)
+            return;
+        uint8_t sum = 0;
+        for (size_t i = 0; i < length && hashed <= offset + i; i += pageSize)
+            sum += *reinterpret_cast<const volatile uint8_t*>(bytes + i);
+        (void)sum;
+    }
+};
+
+}
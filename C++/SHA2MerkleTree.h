@@ -0,0 +1,244 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include "SHA2.h"
+#include "SHA2Tree.h"
+#include <vector>
+
+namespace SHA2 {
+
+// A Merkle tree over mutable leaves that rehashes only what changed.
+//
+// The tree has the RFC 6962 shape of TreeHash, so with leaves from leafHash its root is the
+// TreeHash digest of the same data. It is kept as one flat array of levels from the leaves up:
+// level 0 holds the leaf hashes, and node k of level l + 1 joins nodes 2k and 2k + 1 of level l,
+// or is a copy of node 2k when that is the last node of an odd level.
+//
+// Changed leaves are only marked; commit then walks the levels upwards, hashing each parent of
+// a changed node once however many of its descendants changed, which is O(changed * log n).
+template<typename Hash>
+class MerkleTree {
+public:
+    using Digest = typename Hash::Digest;
+
+    // The sibling hashes from a leaf up to the root, leaving out levels where the path node has no sibling.
+    struct Proof {
+        uint64_t index;
+        uint64_t leafCount;
+        std::vector<Digest> siblings;
+    };
+
+    explicit MerkleTree(size_t leafCount = 1)
+    {
+        resize(leafCount);
+        commit();
+    }
+
+    // Hashes count leaves from leafSize byte pieces of the input, the last of which may be shorter.
+    static MerkleTree fromData(const void* input, size_t length, size_t leafSize)
+    {
+        assert(leafSize);
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(input);
+        MerkleTree tree;
+        tree.resize(length ? (length + leafSize - 1) / leafSize : 1);
+        for (size_t i = 0; i < tree.leafCount(); ++i)
+            tree.setLeafData(i, bytes + i * leafSize, std::min(leafSize, length - i * leafSize));
+        tree.commit();
+        return tree;
+    }
+
+    size_t leafCount() const { return levelSizes[0]; }
+    const Digest& leaf(size_t index) const
+    {
+        assert(index < leafCount());
+        return nodes[index];
+    }
+
+    // Changing the number of leaves keeps every node that only covers unchanged leaves.
+    void resize(size_t count)
+    {
+        assert(count);
+        const size_t oldCount = levelSizes.empty() ? 0 : leafCount();
+        std::vector<size_t> sizes;
+        for (size_t size = count; ; size = (size + 1) / 2) {
+            sizes.push_back(size);
+            if (size == 1)
+                break;
+        }
+        std::vector<Digest> resized(offsetOf(sizes, sizes.size()), TreeHash<Hash>::leafHash("", 0));
+        for (size_t level = 0; level < std::min(sizes.size(), levelSizes.size()); ++level) {
+            const size_t kept = std::min(sizes[level], levelSizes[level]);
+            std::copy(nodes.begin() + levelOffsets[level], nodes.begin() + levelOffsets[level] + kept, resized.begin() + offsetOf(sizes, level));
+        }
+        nodes = std::move(resized);
+        levelSizes = std::move(sizes);
+        levelOffsets.clear();
+        for (size_t level = 0; level <= levelSizes.size(); ++level)
+            levelOffsets.push_back(offsetOf(levelSizes, level));
+
+        // New leaves are dirty, and so is the last old leaf, whose ancestors are all the nodes that
+        // now cover a different range of leaves.
+        for (size_t i = oldCount; i < count; ++i)
+            dirty.push_back(i);
+        if (oldCount)
+            dirty.push_back(std::min(oldCount, count) - 1);
+    }
+
+    void setLeaf(size_t index, const Digest& digest)
+    {
+        assert(index < leafCount());
+        nodes[index] = digest;
+        dirty.push_back(index);
+    }
+
+    void setLeafData(size_t index, const void* bytes, size_t length)
+    {
+        setLeaf(index, TreeHash<Hash>::leafHash(bytes, length));
+    }
+
+    // Rehashes the ancestors of the leaves changed since the last commit and returns the new root.
+    const Digest& commit()
+    {
+        std::vector<size_t> changed;
+        changed.swap(dirty);
+        for (size_t level = 0; level + 1 < levelSizes.size() && !changed.empty(); ++level) {
+            for (size_t& index : changed)
+                index /= 2;
+            std::sort(changed.begin(), changed.end());
+            changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+            for (size_t parent : changed)
+                nodes[levelOffsets[level + 1] + parent] = join(level, parent);
+        }
+        return root();
+    }
+
+    const Digest& root() const
+    {
+        assert(dirty.empty());
+        return nodes.back();
+    }
+
+    Proof proof(size_t index) const
+    {
+        assert(dirty.empty() && index < leafCount());
+        Proof result { index, leafCount(), { } };
+        for (size_t level = 0; level + 1 < levelSizes.size(); ++level, index /= 2) {
+            const size_t sibling = index ^ 1;
+            if (sibling < levelSizes[level])
+                result.siblings.push_back(nodes[levelOffsets[level] + sibling]);
+        }
+        return result;
+    }
+
+    static bool verify(const Digest& leaf, const Proof& proof, const Digest& root)
+    {
+        if (proof.index >= proof.leafCount)
+            return false;
+        Digest digest = leaf;
+        uint64_t index = proof.index;
+        size_t used = 0;
+        for (uint64_t size = proof.leafCount; size > 1; size = (size + 1) / 2, index /= 2) {
+            if ((index ^ 1) >= size)
+                continue;
+            if (used == proof.siblings.size())
+                return false;
+            const Digest& sibling = proof.siblings[used++];
+            digest = index & 1 ? TreeHash<Hash>::node(sibling, digest) : TreeHash<Hash>::node(digest, sibling);
+        }
+        return used == proof.siblings.size() && digest == root;
+    }
+
+    // The leaf count as 8 big-endian bytes followed by every level of the flat array, leaves first,
+    // each digest in its big-endian byte form.
+    std::vector<uint8_t> serialize() const
+    {
+        assert(dirty.empty());
+        std::vector<uint8_t> bytes(sizeof(uint64_t) + nodes.size() * sizeof(Digest));
+        storeBigEndian<uint64_t>(bytes.data(), leafCount());
+        uint8_t* out = bytes.data() + sizeof(uint64_t);
+        for (const Digest& node : nodes) {
+            const auto nodeBytes = digestBytes(node);
+            memcpy(out, nodeBytes.data(), nodeBytes.size());
+            out += nodeBytes.size();
+        }
+        return bytes;
+    }
+
+    // Returns false and leaves the tree unchanged if the bytes are not a serialized tree of this Hash.
+    bool deserialize(const uint8_t* bytes, size_t length)
+    {
+        if (length < sizeof(uint64_t))
+            return false;
+        const uint64_t count = loadBigEndian<uint64_t>(bytes);
+        if (!count || count > length / sizeof(Digest))
+            return false;
+        MerkleTree tree;
+        tree.resize(static_cast<size_t>(count));
+        tree.dirty.clear();
+        if (length != sizeof(uint64_t) + tree.nodes.size() * sizeof(Digest))
+            return false;
+        bytes += sizeof(uint64_t);
+        for (Digest& node : tree.nodes) {
+            for (auto& word : node) {
+                word = loadBigEndian<typename Hash::Register>(bytes);
+                bytes += sizeof(word);
+            }
+        }
+        *this = std::move(tree);
+        return true;
+    }
+
+private:
+    static size_t offsetOf(const std::vector<size_t>& sizes, size_t level)
+    {
+        size_t offset = 0;
+        for (size_t i = 0; i < level; ++i)
+            offset += sizes[i];
+        return offset;
+    }
+
+    Digest join(size_t level, size_t parent) const
+    {
+        const Digest* children = nodes.data() + levelOffsets[level] + 2 * parent;
+        if (2 * parent + 1 == levelSizes[level])
+            return children[0];
+        return TreeHash<Hash>::node(children[0], children[1]);
+    }
+
+    std::vector<Digest> nodes;
+    std::vector<size_t> levelSizes;
+    std::vector<size_t> levelOffsets;
+    std::vector<size_t> dirty;
+};
+
+using SHA256MerkleTree = MerkleTree<SHA256>;
+
+}
@@ -0,0 +1,495 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include "CPUFeatures.h"
+#include "SHA2.h"
+#include <string.h>
+#include <type_traits>
+
+namespace SHA2 {
+
+// Hashes a batch of independent messages by running one message per vector lane.
+// A Kernel compresses one block for each of its Lanes states at once:
+//     static bool isSupported();
+//     static void compress(Register (&state)[8][Lanes], const uint8_t* const (&blocks)[Lanes]);
+// The state is stored word-major so each of the eight words of all lanes fills one vector.
+// Messages of different lengths share the batch; when a lane finishes its message it
+// picks up the next waiting one, so the lanes stay busy until the batch runs out.
+template<typename Hash, typename Kernel>
+class MultiBuffer {
+public:
+    using Register = typename Hash::Register;
+    using Digest = typename Hash::Digest;
+    static constexpr size_t Lanes = Kernel::Lanes;
+
+    static void digest(const Span* messages, size_t count, Digest* digests)
+    {
+        if (!Kernel::isSupported()) {
+            for (size_t i = 0; i < count; ++i) {
+                Hash hash;
+                hash.addBytes(messages[i].data, messages[i].length);
+                digests[i] = hash.digest();
+            }
+            return;
+        }
+
+        alignas(64) Register state[8][Lanes];
+        Lane lanes[Lanes];
+        const uint8_t* blocks[Lanes];
+        size_t nextMessage = 0;
+        size_t activeLanes = 0;
+        for (size_t lane = 0; lane < Lanes; ++lane) {
+            if (nextMessage < count) {
+                lanes[lane].start(nextMessage, messages[nextMessage], state, lane);
+                ++nextMessage;
+                ++activeLanes;
+            } else
+                lanes[lane].message = NoMessage;
+        }
+
+        while (activeLanes) {
+            for (size_t lane = 0; lane < Lanes; ++lane)
+                blocks[lane] = lanes[lane].message == NoMessage ? idleBlock() : lanes[lane].nextBlock();
+            Kernel::compress(state, blocks);
+            for (size_t lane = 0; lane < Lanes; ++lane) {
+                Lane& current = lanes[lane];
+                if (current.message == NoMessage || current.remainingBlocks())
+                    continue;
+                for (size_t i = 0; i < digests[current.message].size(); ++i)
+                    digests[current.message][i] = state[i][lane];
+                if (nextMessage < count) {
+                    current.start(nextMessage, messages[nextMessage], state, lane);
+                    ++nextMessage;
+                } else {
+                    current.message = NoMessage;
+                    --activeLanes;
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr size_t BlockSizeBytes = Hash::BlockSizeBytes;
+    static constexpr size_t LengthSizeBytes = 2 * sizeof(Register);
+    static constexpr size_t NoMessage = static_cast<size_t>(-1);
+
+    // Lanes without a message still go through the kernel, so they get a block whose result is ignored.
+    static const uint8_t* idleBlock()
+    {
+        static const uint8_t block[BlockSizeBytes] = { };
+        return block;
+    }
+
+    struct Lane {
+        size_t message;
+        const uint8_t* bytes;
+        size_t wholeBlocks;
+        size_t finalBlocks;
+        size_t finalBlocksUsed;
+        uint8_t finalBlockBytes[2 * BlockSizeBytes];
+
+        void start(size_t index, const Span& input, Register (&state)[8][Lanes], size_t lane)
+        {
+            message = index;
+            bytes = reinterpret_cast<const uint8_t*>(input.data);
+            wholeBlocks = input.length / BlockSizeBytes;
+            finalBlocksUsed = 0;
+
+            // Pad the partial block at the end of the message the same way SHA2::finalize does.
+            const size_t tail = input.length % BlockSizeBytes;
+            finalBlocks = tail + 1 + LengthSizeBytes <= BlockSizeBytes ? 1 : 2;
+            const size_t finalSize = finalBlocks * BlockSizeBytes;
+            if (tail)
+                memcpy(finalBlockBytes, bytes + wholeBlocks * BlockSizeBytes, tail);
+            finalBlockBytes[tail] = 0x80;
+            memset(finalBlockBytes + tail + 1, 0, finalSize - tail - 1);
+            storeBigEndian<uint64_t>(finalBlockBytes + finalSize - sizeof(uint64_t), static_cast<uint64_t>(input.length) * 8);
+
+            for (size_t i = 0; i < 8; ++i)
+                state[i][lane] = Hash::initialHash()[i];
+        }
+
+        size_t remainingBlocks() const { return wholeBlocks + finalBlocks - finalBlocksUsed; }
+
+        const uint8_t* nextBlock()
+        {
+            if (wholeBlocks) {
+                const uint8_t* block = bytes;
+                bytes += BlockSizeBytes;
+                --wholeBlocks;
+                return block;
+            }
+            return finalBlockBytes + BlockSizeBytes * finalBlocksUsed++;
+        }
+    };
+};
+
+#ifdef SHA2_X86
+
+// Eight SHA-256 compressions in the 32-bit lanes of AVX2 registers.
+struct SHA256AVX2Kernel {
+    using Register = uint32_t;
+    static constexpr size_t Lanes = 8;
+
+    static bool isSupported() { return CPUFeatures::host().avx2; }
+
+    SHA2_TARGET("avx2")
+    static void compress(uint32_t (&state)[8][Lanes], const uint8_t* const (&blocks)[Lanes])
+    {
+        const __m256i byteSwap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        __m256i w[16];
+        for (size_t half = 0; half < 2; ++half) {
+            __m256i rows[8];
+            for (size_t lane = 0; lane < Lanes; ++lane)
+                rows[lane] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blocks[lane] + half * 32));
+            transpose(rows);
+            for (size_t i = 0; i < 8; ++i)
+                w[half * 8 + i] = _mm256_shuffle_epi8(rows[i], byteSwap);
+        }
+
+        __m256i a = _mm256_load_si256(reinterpret_cast<const __m256i*>(state[0]));
+        __m256i b = _mm256_load_si256(reinterpret_cast<const __m256i*>(state[1]));
+        __m256i c = _mm256_load_si256(reinterpret_cast<const __m256i*>(state[2]));
+        __m256i d = _mm256_load_si256(reinterpret_cast<const __m256i*>(state[3]));
+        __m256i e = _mm256_load_si256(reinterpret_cast<const __m256i*>(state[4]));
+        __m256i f = _mm256_load_si256(reinterpret_cast<const __m256i*>(state[5]));
+        __m256i g = _mm256_load_si256(reinterpret_cast<const __m256i*>(state[6]));
+        __m256i h = _mm256_load_si256(reinterpret_cast<const __m256i*>(state[7]));
+        for (size_t i = 0; i < 64; ++i) {
+            if (i >= 16) {
+                __m256i w15 = w[(i - 15) & 15];
+                __m256i w2 = w[(i - 2) & 15];
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotateRight<7>(w15), rotateRight<18>(w15)), _mm256_srli_epi32(w15, 3));
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotateRight<17>(w2), rotateRight<19>(w2)), _mm256_srli_epi32(w2, 10));
+                w[i & 15] = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0), _mm256_add_epi32(w[(i - 7) & 15], s1));
+            }
+            __m256i S1 = _mm256_xor_si256(_mm256_xor_si256(rotateRight<6>(e), rotateRight<11>(e)), rotateRight<25>(e));
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i k = _mm256_set1_epi32(static_cast<int>(RoundConstants32[i]));
+            __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1), _mm256_add_epi32(_mm256_add_epi32(ch, k), w[i & 15]));
+            __m256i S0 = _mm256_xor_si256(_mm256_xor_si256(rotateRight<2>(a), rotateRight<13>(a)), rotateRight<22>(a));
+            __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+            __m256i t2 = _mm256_add_epi32(S0, maj);
+            h = g;
+            g = f;
+            f = e;
+            e = _mm256_add_epi32(d, t1);
+            d = c;
+            c = b;
+            b = a;
+            a = _mm256_add_epi32(t1, t2);
+        }
+        accumulate(state[0], a);
+        accumulate(state[1], b);
+        accumulate(state[2], c);
+        accumulate(state[3], d);
+        accumulate(state[4], e);
+        accumulate(state[5], f);
+        accumulate(state[6], g);
+        accumulate(state[7], h);
+    }
+
+private:
+    template<int Bits>
+    SHA2_TARGET("avx2")
+    static __m256i rotateRight(__m256i x) { return _mm256_or_si256(_mm256_srli_epi32(x, Bits), _mm256_slli_epi32(x, 32 - Bits)); }
+
+    SHA2_TARGET("avx2")
+    static void accumulate(uint32_t* words, __m256i value)
+    {
+        __m256i* pointer = reinterpret_cast<__m256i*>(words);
+        _mm256_store_si256(pointer, _mm256_add_epi32(_mm256_load_si256(pointer), value));
+    }
+
+    // Turns eight rows of eight words, one row per lane, into eight vectors that each hold one word of every lane.
+    SHA2_TARGET("avx2")
+    static void transpose(__m256i (&rows)[8])
+    {
+        __m256i t0 = _mm256_unpacklo_epi32(rows[0], rows[1]);
+        __m256i t1 = _mm256_unpackhi_epi32(rows[0], rows[1]);
+        __m256i t2 = _mm256_unpacklo_epi32(rows[2], rows[3]);
+        __m256i t3 = _mm256_unpackhi_epi32(rows[2], rows[3]);
+        __m256i t4 = _mm256_unpacklo_epi32(rows[4], rows[5]);
+        __m256i t5 = _mm256_unpackhi_epi32(rows[4], rows[5]);
+        __m256i t6 = _mm256_unpacklo_epi32(rows[6], rows[7]);
+        __m256i t7 = _mm256_unpackhi_epi32(rows[6], rows[7]);
+        __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+        __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+        __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+        __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+        __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+        __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+        __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+        __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+        rows[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+        rows[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+        rows[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+        rows[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+        rows[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+        rows[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+        rows[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+        rows[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+    }
+};
+
+using SHA224x8 = MultiBuffer<SHA224, SHA256AVX2Kernel>;
+using SHA256x8 = MultiBuffer<SHA256, SHA256AVX2Kernel>;
+
+// Loading, byte swapping and transposing blocks for the AVX-512 kernels, which differ only in word size.
+// Byte swapping uses rotations because a byte shuffle of a whole register needs AVX-512 BW.
+template<typename Register> struct AVX512Words;
+
+template<>
+struct AVX512Words<uint32_t> {
+    SHA2_TARGET("avx512f")
+    static __m512i add(__m512i a, __m512i b) { return _mm512_add_epi32(a, b); }
+    SHA2_TARGET("avx512f")
+    static __m512i broadcast(uint32_t value) { return _mm512_set1_epi32(static_cast<int>(value)); }
+    template<int Bits>
+    SHA2_TARGET("avx512f")
+    static __m512i rotateRight(__m512i x) { return _mm512_ror_epi32(x, Bits); }
+    template<int Bits>
+    SHA2_TARGET("avx512f")
+    static __m512i shiftRight(__m512i x) { return _mm512_srli_epi32(x, Bits); }
+
+    SHA2_TARGET("avx512f")
+    static __m512i byteSwap(__m512i x)
+    {
+        return _mm512_ternarylogic_epi32(_mm512_set1_epi32(static_cast<int>(0xFF00FF00)), _mm512_ror_epi32(x, 8), _mm512_rol_epi32(x, 8), 0xCA);
+    }
+
+    // One block per lane becomes sixteen vectors that each hold one message word of every lane.
+    SHA2_TARGET("avx512f")
+    static void load(const uint8_t* const (&blocks)[16], __m512i (&w)[16])
+    {
+        __m512i rows[16];
+        for (size_t lane = 0; lane < 16; ++lane)
+            rows[lane] = _mm512_loadu_si512(blocks[lane]);
+        // 4x4 transposes of words inside each 128-bit part, then of the 128-bit parts across registers.
+        __m512i t[16];
+        for (size_t i = 0; i < 16; i += 2) {
+            t[i] = _mm512_unpacklo_epi32(rows[i], rows[i + 1]);
+            t[i + 1] = _mm512_unpackhi_epi32(rows[i], rows[i + 1]);
+        }
+        for (size_t i = 0; i < 16; i += 4) {
+            rows[i] = _mm512_unpacklo_epi64(t[i], t[i + 2]);
+            rows[i + 1] = _mm512_unpackhi_epi64(t[i], t[i + 2]);
+            rows[i + 2] = _mm512_unpacklo_epi64(t[i + 1], t[i + 3]);
+            rows[i + 3] = _mm512_unpackhi_epi64(t[i + 1], t[i + 3]);
+        }
+        for (size_t j = 0; j < 4; ++j) {
+            __m512i parts[4];
+            transposeParts(rows[j], rows[4 + j], rows[8 + j], rows[12 + j], parts);
+            for (size_t part = 0; part < 4; ++part)
+                w[4 * part + j] = byteSwap(parts[part]);
+        }
+    }
+
+    // Gathers 128-bit part i of a, b, c and d into parts[i].
+    SHA2_TARGET("avx512f")
+    static void transposeParts(__m512i a, __m512i b, __m512i c, __m512i d, __m512i (&parts)[4])
+    {
+        const __m512i abLow = _mm512_shuffle_i32x4(a, b, 0x44);
+        const __m512i abHigh = _mm512_shuffle_i32x4(a, b, 0xEE);
+        const __m512i cdLow = _mm512_shuffle_i32x4(c, d, 0x44);
+        const __m512i cdHigh = _mm512_shuffle_i32x4(c, d, 0xEE);
+        parts[0] = _mm512_shuffle_i32x4(abLow, cdLow, 0x88);
+        parts[1] = _mm512_shuffle_i32x4(abLow, cdLow, 0xDD);
+        parts[2] = _mm512_shuffle_i32x4(abHigh, cdHigh, 0x88);
+        parts[3] = _mm512_shuffle_i32x4(abHigh, cdHigh, 0xDD);
+    }
+};
+
+template<>
+struct AVX512Words<uint64_t> {
+    SHA2_TARGET("avx512f")
+    static __m512i add(__m512i a, __m512i b) { return _mm512_add_epi64(a, b); }
+    SHA2_TARGET("avx512f")
+    static __m512i broadcast(uint64_t value) { return _mm512_set1_epi64(static_cast<long long>(value)); }
+    template<int Bits>
+    SHA2_TARGET("avx512f")
+    static __m512i rotateRight(__m512i x) { return _mm512_ror_epi64(x, Bits); }
+    template<int Bits>
+    SHA2_TARGET("avx512f")
+    static __m512i shiftRight(__m512i x) { return _mm512_srli_epi64(x, Bits); }
+
+    SHA2_TARGET("avx512f")
+    static __m512i byteSwap(__m512i x) { return _mm512_ror_epi64(AVX512Words<uint32_t>::byteSwap(x), 32); }
+
+    // One 128-byte block per lane becomes sixteen vectors that each hold one message word of every lane.
+    SHA2_TARGET("avx512f")
+    static void load(const uint8_t* const (&blocks)[8], __m512i (&w)[16])
+    {
+        for (size_t half = 0; half < 2; ++half) {
+            __m512i t[8];
+            for (size_t lane = 0; lane < 8; lane += 2) {
+                const __m512i first = _mm512_loadu_si512(blocks[lane] + half * 64);
+                const __m512i second = _mm512_loadu_si512(blocks[lane + 1] + half * 64);
+                t[lane] = _mm512_unpacklo_epi64(first, second);
+                t[lane + 1] = _mm512_unpackhi_epi64(first, second);
+            }
+            for (size_t j = 0; j < 2; ++j) {
+                __m512i parts[4];
+                AVX512Words<uint32_t>::transposeParts(t[j], t[2 + j], t[4 + j], t[6 + j], parts);
+                for (size_t part = 0; part < 4; ++part)
+                    w[half * 8 + 2 * part + j] = byteSwap(parts[part]);
+            }
+        }
+    }
+};
+
+// SHA-256 in the sixteen 32-bit lanes or SHA-512 in the eight 64-bit lanes of AVX-512 registers.
+// The choice and majority functions and the three-way exclusive ors of the sigma functions are
+// each one vpternlog, and the rotations are vprord or vprorq.
+template<typename RegisterType, size_t Rounds, const std::array<RegisterType, Rounds>& RoundConstants, const std::array<size_t, 12>& ShiftConstants>
+struct AVX512Kernel {
+    using Register = RegisterType;
+    static constexpr size_t Lanes = 64 / sizeof(Register);
+
+    static bool isSupported() { return CPUFeatures::host().avx512; }
+
+    SHA2_TARGET("avx512f")
+    static void compress(Register (&state)[8][Lanes], const uint8_t* const (&blocks)[Lanes])
+    {
+        __m512i w[16];
+        Words::load(blocks, w);
+        __m512i a = _mm512_load_si512(state[0]);
+        __m512i b = _mm512_load_si512(state[1]);
+        __m512i c = _mm512_load_si512(state[2]);
+        __m512i d = _mm512_load_si512(state[3]);
+        __m512i e = _mm512_load_si512(state[4]);
+        __m512i f = _mm512_load_si512(state[5]);
+        __m512i g = _mm512_load_si512(state[6]);
+        __m512i h = _mm512_load_si512(state[7]);
+        for (size_t i = 0; i < Rounds; ++i) {
+            if (i >= 16) {
+                const __m512i w15 = w[(i - 15) & 15];
+                const __m512i w2 = w[(i - 2) & 15];
+                const __m512i s0 = exclusiveOr(Words::template rotateRight<ShiftConstants[0]>(w15), Words::template rotateRight<ShiftConstants[1]>(w15), Words::template shiftRight<ShiftConstants[2]>(w15));
+                const __m512i s1 = exclusiveOr(Words::template rotateRight<ShiftConstants[3]>(w2), Words::template rotateRight<ShiftConstants[4]>(w2), Words::template shiftRight<ShiftConstants[5]>(w2));
+                w[i & 15] = Words::add(Words::add(w[i & 15], s0), Words::add(w[(i - 7) & 15], s1));
+            }
+            const __m512i S1 = exclusiveOr(Words::template rotateRight<ShiftConstants[6]>(e), Words::template rotateRight<ShiftConstants[7]>(e), Words::template rotateRight<ShiftConstants[8]>(e));
+            const __m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xCA);
+            const __m512i t1 = Words::add(Words::add(h, S1), Words::add(Words::add(ch, Words::broadcast(RoundConstants[i])), w[i & 15]));
+            const __m512i S0 = exclusiveOr(Words::template rotateRight<ShiftConstants[9]>(a), Words::template rotateRight<ShiftConstants[10]>(a), Words::template rotateRight<ShiftConstants[11]>(a));
+            const __m512i maj = _mm512_ternarylogic_epi32(a, b, c, 0xE8);
+            h = g;
+            g = f;
+            f = e;
+            e = Words::add(d, t1);
+            d = c;
+            c = b;
+            b = a;
+            a = Words::add(t1, Words::add(S0, maj));
+        }
+        accumulate(state[0], a);
+        accumulate(state[1], b);
+        accumulate(state[2], c);
+        accumulate(state[3], d);
+        accumulate(state[4], e);
+        accumulate(state[5], f);
+        accumulate(state[6], g);
+        accumulate(state[7], h);
+    }
+
+private:
+    using Words = AVX512Words<Register>;
+
+    SHA2_TARGET("avx512f")
+    static __m512i exclusiveOr(__m512i x, __m512i y, __m512i z) { return _mm512_ternarylogic_epi32(x, y, z, 0x96); }
+
+    SHA2_TARGET("avx512f")
+    static void accumulate(Register* words, __m512i value)
+    {
+        _mm512_store_si512(words, Words::add(_mm512_load_si512(words), value));
+    }
+};
+
+using SHA256AVX512Kernel = AVX512Kernel<uint32_t, 64, RoundConstants32, ShiftConstants32>;
+using SHA512AVX512Kernel = AVX512Kernel<uint64_t, 80, RoundConstants64, ShiftConstants64>;
+
+using SHA224x16 = MultiBuffer<SHA224, SHA256AVX512Kernel>;
+using SHA256x16 = MultiBuffer<SHA256, SHA256AVX512Kernel>;
+using SHA384x8 = MultiBuffer<SHA314, SHA512AVX512Kernel>;
+using SHA512x8 = MultiBuffer<SHA512, SHA512AVX512Kernel>;
+
+#endif
+
+// Hashes a batch with the kernel that is fastest for its size on this CPU, measured on one core:
+// the SHA extensions beat the AVX-512 lanes until the batch fills half of them, and without the
+// SHA extensions any kernel beats hashing one message at a time from two messages on.
+template<typename Hash>
+class BatchHash {
+public:
+    using Digest = typename Hash::Digest;
+
+    static void digest(const Span* messages, size_t count, Digest* digests)
+    {
+        dispatch<Hash>(messages, count, digests);
+    }
+
+private:
+#ifdef SHA2_X86
+    template<typename Hasher, typename std::enable_if_t<sizeof(typename Hasher::Register) == 4>* = nullptr>
+    static void dispatch(const Span* messages, size_t count, Digest* digests)
+    {
+        const CPUFeatures& features = CPUFeatures::host();
+        if (features.avx512 && count >= (features.sha ? SHA256AVX512Kernel::Lanes / 2 : 2))
+            MultiBuffer<Hasher, SHA256AVX512Kernel>::digest(messages, count, digests);
+        else if (features.avx2 && !features.sha && count >= 2)
+            MultiBuffer<Hasher, SHA256AVX2Kernel>::digest(messages, count, digests);
+        else
+            digestEach(messages, count, digests);
+    }
+
+    template<typename Hasher, typename std::enable_if_t<sizeof(typename Hasher::Register) == 8>* = nullptr>
+    static void dispatch(const Span* messages, size_t count, Digest* digests)
+    {
+        if (CPUFeatures::host().avx512 && count >= 2)
+            MultiBuffer<Hasher, SHA512AVX512Kernel>::digest(messages, count, digests);
+        else
+            digestEach(messages, count, digests);
+    }
+#else
+    template<typename Hasher>
+    static void dispatch(const Span* messages, size_t count, Digest* digests) { digestEach(messages, count, digests); }
+#endif
+
+    static void digestEach(const Span* messages, size_t count, Digest* digests)
+    {
+        for (size_t i = 0; i < count; ++i)
+            digests[i] = Hash::digest(messages[i].data, messages[i].length);
+    }
+};
+
+}
@@ -0,0 +1,360 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include "SHA2.h"
+#include "SHA2MultiBuffer.h"
+#include "ThreadPool.h"
+#include <deque>
+#include <future>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+
+namespace SHA2 {
+
+// Hashes many streams at once on a fixed set of worker threads. Chunks of one stream
+// are always hashed in the order they were added, because a stream is only given to one
+// worker at a time; different streams proceed in parallel.
+//
+// When a worker finds several SHA-224 or SHA-256 streams with data ready and the CPU has
+// AVX2 but not the SHA extensions, it hashes their blocks together in the lanes of the
+// multi-buffer kernel. With the SHA extensions one stream per core is faster.
+template<typename Hash>
+class HashingService {
+public:
+    using Digest = typename Hash::Digest;
+    using StreamID = uint64_t;
+    using Callback = std::function<void(const Digest&)>;
+
+    // Zero threads means one per hardware thread.
+    explicit HashingService(size_t threads = 0)
+    {
+        if (!threads)
+            threads = ThreadPool::defaultThreadCount();
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back([this] { run(); });
+    }
+
+    // Finishes the work that was already handed over. Streams that were never finished are dropped.
+    ~HashingService()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        streamReady.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    HashingService(const HashingService&) = delete;
+    HashingService& operator=(const HashingService&) = delete;
+
+    StreamID open()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const StreamID id = nextStreamID++;
+        streams.emplace(id, std::make_shared<Stream>());
+        return id;
+    }
+
+    void addBytes(StreamID id, std::vector<uint8_t> chunk)
+    {
+        if (chunk.empty())
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        Stream& stream = find(id);
+        assert(!stream.finishing);
+        stream.chunks.push_back(std::move(chunk));
+        schedule(id, stream);
+    }
+
+    void addBytes(StreamID id, const void* bytes, size_t length)
+    {
+        const uint8_t* begin = reinterpret_cast<const uint8_t*>(bytes);
+        addBytes(id, std::vector<uint8_t>(begin, begin + length));
+    }
+
+    // Ends the stream; its digest is delivered once all of its chunks are hashed.
+    std::future<Digest> finish(StreamID id)
+    {
+        auto promise = std::make_shared<std::promise<Digest>>();
+        std::future<Digest> future = promise->get_future();
+        finish(id, [promise](const Digest& digest) { promise->set_value(digest); });
+        return future;
+    }
+
+    // The callback runs on a worker thread, or on this thread if the stream has nothing left to hash.
+    void finish(StreamID id, Callback callback)
+    {
+        std::shared_ptr<Stream> stream;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto iterator = streams.find(id);
+            assert(iterator != streams.end());
+            stream = iterator->second;
+            assert(!stream->finishing);
+            stream->finishing = true;
+            stream->callback = std::move(callback);
+            if (stream->scheduled)
+                return;
+            streams.erase(iterator);
+        }
+        stream->callback(stream->hash.digest());
+    }
+
+private:
+    struct Stream {
+        Hash hash;
+        std::deque<std::vector<uint8_t>> chunks;
+        bool scheduled { false };
+        bool finishing { false };
+        Callback callback;
+    };
+
+    struct Work {
+        StreamID id;
+        std::shared_ptr<Stream> stream;
+        std::deque<std::vector<uint8_t>> chunks;
+    };
+
+    static constexpr size_t MaximumBatch = 8;
+
+    Stream& find(StreamID id)
+    {
+        auto iterator = streams.find(id);
+        assert(iterator != streams.end());
+        return *iterator->second;
+    }
+
+    void schedule(StreamID id, Stream& stream)
+    {
+        if (stream.scheduled)
+            return;
+        stream.scheduled = true;
+        readyStreams.push_back(id);
+        streamReady.notify_one();
+    }
+
+    void run()
+    {
+        std::vector<Work> batch;
+        while (true) {
+            batch.clear();
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                streamReady.wait(lock, [this] { return stopping || !readyStreams.empty(); });
+                if (readyStreams.empty())
+                    return;
+                const size_t batchSize = useLanes() ? MaximumBatch : 1;
+                while (!readyStreams.empty() && batch.size() < batchSize) {
+                    const StreamID id = readyStreams.front();
+                    readyStreams.pop_front();
+                    std::shared_ptr<Stream> stream = streams.at(id);
+                    batch.push_back({ id, stream, std::move(stream->chunks) });
+                    stream->chunks.clear();
+                }
+            }
+
+            if (batch.size() > 1)
+                hashLanes<Hash>(batch);
+            else
+                hashEach(batch);
+
+            std::vector<std::shared_ptr<Stream>> finished;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (Work& work : batch) {
+                    Stream& stream = *work.stream;
+                    if (!stream.chunks.empty()) {
+                        readyStreams.push_back(work.id);
+                        streamReady.notify_one();
+                        continue;
+                    }
+                    stream.scheduled = false;
+                    if (stream.finishing) {
+                        finished.push_back(work.stream);
+                        streams.erase(work.id);
+                    }
+                }
+            }
+            for (const std::shared_ptr<Stream>& stream : finished)
+                stream->callback(stream->hash.digest());
+        }
+    }
+
+    static bool useLanes()
+    {
+#ifdef SHA2_X86
+        return std::is_same<typename Hash::Register, uint32_t>::value && SHA256AVX2Kernel::isSupported() && !CPUFeatures::host().sha;
+#else
+        return false;
+#endif
+    }
+
+    // Hands out the whole blocks of a stream's buffered tail followed by its chunks.
+    // Blocks that straddle two chunks are assembled in the staging block.
+    class BlockFeeder {
+    public:
+        void start(const typename Hash::Midstate& midstate, const std::deque<std::vector<uint8_t>>& input)
+        {
+            chunks = &input;
+            chunk = 0;
+            offset = 0;
+            staged = midstate.bufferContents;
+            memcpy(staging, midstate.buffer, staged);
+        }
+
+        const uint8_t* next()
+        {
+            while (chunk < chunks->size()) {
+                const std::vector<uint8_t>& bytes = (*chunks)[chunk];
+                const size_t remaining = bytes.size() - offset;
+                if (!staged && remaining >= Hash::BlockSizeBytes) {
+                    const uint8_t* block = bytes.data() + offset;
+                    advance(Hash::BlockSizeBytes);
+                    return block;
+                }
+                const size_t copied = std::min(Hash::BlockSizeBytes - staged, remaining);
+                memcpy(staging + staged, bytes.data() + offset, copied);
+                staged += copied;
+                advance(copied);
+                if (staged == Hash::BlockSizeBytes) {
+                    staged = 0;
+                    return staging;
+                }
+            }
+            return nullptr;
+        }
+
+        // After next() returns null, the bytes that did not make a whole block.
+        const uint8_t* tail() const { return staging; }
+        size_t tailLength() const { return staged; }
+
+    private:
+        void advance(size_t length)
+        {
+            offset += length;
+            if (offset == (*chunks)[chunk].size()) {
+                ++chunk;
+                offset = 0;
+            }
+        }
+
+        const std::deque<std::vector<uint8_t>>* chunks;
+        size_t chunk;
+        size_t offset;
+        uint8_t staging[Hash::BlockSizeBytes];
+        size_t staged;
+    };
+
+#ifdef SHA2_X86
+    template<typename Hasher, typename std::enable_if_t<std::is_same<typename Hasher::Register, uint32_t>::value>* = nullptr>
+    static void hashLanes(std::vector<Work>& batch)
+    {
+        using Kernel = SHA256AVX2Kernel;
+        static const uint8_t idleBlock[Hash::BlockSizeBytes] = { };
+        alignas(64) uint32_t state[8][Kernel::Lanes];
+        const uint8_t* blocks[Kernel::Lanes];
+        BlockFeeder feeders[Kernel::Lanes];
+        typename Hash::Midstate midstates[Kernel::Lanes];
+        uint64_t added[Kernel::Lanes] = { };
+
+        for (size_t lane = 0; lane < batch.size(); ++lane) {
+            midstates[lane] = batch[lane].stream->hash.midstate();
+            feeders[lane].start(midstates[lane], batch[lane].chunks);
+            for (size_t i = 0; i < 8; ++i)
+                state[i][lane] = midstates[lane].state[i];
+            for (const std::vector<uint8_t>& chunk : batch[lane].chunks)
+                added[lane] += chunk.size();
+        }
+        for (size_t lane = batch.size(); lane < Kernel::Lanes; ++lane)
+            blocks[lane] = idleBlock;
+
+        // Lanes that run out of blocks keep compressing the idle block until every lane is done,
+        // so their state is saved when they finish.
+        uint32_t finishedState[8][Kernel::Lanes];
+        size_t active = batch.size();
+        bool done[Kernel::Lanes] = { };
+        while (true) {
+            for (size_t lane = 0; lane < batch.size(); ++lane) {
+                if (done[lane])
+                    continue;
+                blocks[lane] = feeders[lane].next();
+                if (!blocks[lane]) {
+                    done[lane] = true;
+                    --active;
+                    blocks[lane] = idleBlock;
+                    for (size_t i = 0; i < 8; ++i)
+                        finishedState[i][lane] = state[i][lane];
+                }
+            }
+            if (!active)
+                break;
+            Kernel::compress(state, blocks);
+        }
+
+        for (size_t lane = 0; lane < batch.size(); ++lane) {
+            typename Hash::Midstate& midstate = midstates[lane];
+            for (size_t i = 0; i < 8; ++i)
+                midstate.state[i] = finishedState[i][lane];
+            midstate.length += added[lane];
+            midstate.bufferContents = feeders[lane].tailLength();
+            memcpy(midstate.buffer, feeders[lane].tail(), midstate.bufferContents);
+            batch[lane].stream->hash = Hash(midstate);
+        }
+    }
+
+    template<typename Hasher, typename std::enable_if_t<!std::is_same<typename Hasher::Register, uint32_t>::value>* = nullptr>
+    static void hashLanes(std::vector<Work>& batch) { hashEach(batch); }
+#else
+    template<typename Hasher>
+    static void hashLanes(std::vector<Work>& batch) { hashEach(batch); }
+#endif
+
+    static void hashEach(std::vector<Work>& batch)
+    {
+        for (Work& work : batch) {
+            for (const std::vector<uint8_t>& chunk : work.chunks)
+                work.stream->hash.addBytes(chunk.data(), chunk.size());
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::unordered_map<StreamID, std::shared_ptr<Stream>> streams;
+    std::deque<StreamID> readyStreams;
+    StreamID nextStreamID { 0 };
+    bool stopping { false };
+    std::mutex mutex;
+    std::condition_variable streamReady;
+};
+
+}
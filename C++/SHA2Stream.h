@@ -0,0 +1,166 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include "SHA2.h"
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+namespace SHA2 {
+
+// Reads at most size bytes into buffer and returns how many it read, zero at the end of the
+// stream, or a negative value on an error.
+using ReadFunction = std::function<ptrdiff_t(uint8_t* buffer, size_t size)>;
+
+// Hashes a stream that can only be read front to back, such as a pipe, while it is being read.
+// A reader thread fills a ring of bufferCount aligned buffers and the calling thread hashes
+// each one as soon as it is full, so reading the next buffers overlaps hashing this one.
+// Buffers are a whole number of blocks and only the last one can be partly filled, so addBytes
+// compresses them in place and never copies into its block buffer.
+// Returns false if reading fails.
+template<typename Hash>
+bool hashStream(const ReadFunction& read, typename Hash::Digest& digest, size_t bufferSize = 1024 * 1024, size_t bufferCount = 3)
+{
+    const size_t alignment = 4096;
+    bufferSize = std::max(Hash::BlockSizeBytes, bufferSize / Hash::BlockSizeBytes * Hash::BlockSizeBytes);
+    bufferCount = std::max<size_t>(bufferCount, 2);
+    std::unique_ptr<uint8_t[]> storage(new uint8_t[bufferSize * bufferCount + alignment]);
+    uint8_t* buffers = storage.get() + (alignment - reinterpret_cast<uintptr_t>(storage.get()) % alignment) % alignment;
+
+    // Buffer i % bufferCount holds the i-th piece of the stream. The reader fills pieces while
+    // fewer than bufferCount are waiting to be hashed; a piece shorter than bufferSize is the last.
+    std::vector<size_t> lengths(bufferCount);
+    size_t filled = 0;
+    size_t hashed = 0;
+    bool failed = false;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable pieceFilled;
+    std::condition_variable pieceHashed;
+
+    std::thread reader([&] {
+        for (size_t piece = 0; ; ++piece) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                pieceHashed.wait(lock, [&] { return stopping || piece - hashed < bufferCount; });
+                if (stopping)
+                    return;
+            }
+            uint8_t* buffer = buffers + piece % bufferCount * bufferSize;
+            size_t length = 0;
+            bool error = false;
+            while (length < bufferSize) {
+                const ptrdiff_t count = read(buffer + length, bufferSize - length);
+                if (count <= 0) {
+                    error = count < 0;
+                    break;
+                }
+                length += static_cast<size_t>(count);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                lengths[piece % bufferCount] = length;
+                failed = error;
+                filled = piece + 1;
+            }
+            pieceFilled.notify_one();
+            if (error || length < bufferSize)
+                return;
+        }
+    });
+
+    Hash hash;
+    bool result = true;
+    for (size_t piece = 0; ; ++piece) {
+        size_t length;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            pieceFilled.wait(lock, [&] { return filled > piece; });
+            if (failed && filled == piece + 1) {
+                result = false;
+                break;
+            }
+            length = lengths[piece % bufferCount];
+        }
+        hash.addBytes(buffers + piece % bufferCount * bufferSize, length);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            hashed = piece + 1;
+        }
+        pieceHashed.notify_one();
+        if (length < bufferSize)
+            break;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    pieceHashed.notify_one();
+    reader.join();
+    if (result)
+        digest = hash.digest();
+    return result;
+}
+
+template<typename Hash>
+bool hashStream(FILE* file, typename Hash::Digest& digest, size_t bufferSize = 1024 * 1024, size_t bufferCount = 3)
+{
+    return hashStream<Hash>([file](uint8_t* buffer, size_t size) -> ptrdiff_t {
+        const size_t count = fread(buffer, 1, size, file);
+        return count || !ferror(file) ? static_cast<ptrdiff_t>(count) : -1;
+    }, digest, bufferSize, bufferCount);
+}
+
+#ifndef _WIN32
+// Reads a file descriptor directly, such as 0 for standard input, without stdio's own buffer in between.
+template<typename Hash>
+bool hashStream(int file, typename Hash::Digest& digest, size_t bufferSize = 1024 * 1024, size_t bufferCount = 3)
+{
+    return hashStream<Hash>([file](uint8_t* buffer, size_t size) -> ptrdiff_t {
+        while (true) {
+            const ssize_t count = ::read(file, buffer, size);
+            if (count >= 0 || errno != EINTR)
+                return count;
+        }
+    }, digest, bufferSize, bufferCount);
+}
+#endif
+
+}
@@ -0,0 +1,183 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include "SHA2.h"
+#include "ThreadPool.h"
+#include <memory>
+#include <vector>
+
+namespace SHA2 {
+
+// Tree hashing, so the leaves of one large input can be hashed on many cores.
+//
+// The input is cut into leaves of leafSize bytes; only the last leaf may be shorter,
+// and an empty input is one empty leaf. The tree has the shape of RFC 6962 section 2.1:
+//     leaf hash = Hash(0x00 || leaf bytes)
+//     node hash = Hash(0x01 || left child || right child)
+// where a tree of n > 1 leaves has the largest power of two below n leaves on its left
+// and the rest on its right. The prefix bytes keep a leaf from ever hashing like a node.
+// The root depends on the leaf size, so both sides of a comparison must agree on it.
+template<typename Hash>
+class TreeHash {
+public:
+    using Digest = typename Hash::Digest;
+    static constexpr size_t DefaultLeafSize = 1024 * 1024;
+
+    explicit TreeHash(size_t leafSize = DefaultLeafSize)
+        : leafSize(leafSize)
+    {
+        assert(leafSize);
+        startLeaf();
+    }
+
+    void addBytes(const void* input, size_t length)
+    {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(input);
+        while (length) {
+            const size_t added = std::min(length, leafSize - leafBytes);
+            leaf.addBytes(bytes, added);
+            leafBytes += added;
+            bytes += added;
+            length -= added;
+            if (leafBytes == leafSize) {
+                addLeaf(leaf.digest());
+                startLeaf();
+            }
+        }
+    }
+
+    Digest digest()
+    {
+        if (leafBytes || subtrees.empty()) {
+            addLeaf(leaf.digest());
+            startLeaf();
+        }
+        // The stack holds perfect subtrees of decreasing size, and RFC 6962 joins them from the right.
+        Digest root = subtrees.back().digest;
+        for (size_t i = subtrees.size() - 1; i--; )
+            root = node(subtrees[i].digest, root);
+        return root;
+    }
+
+    // Hashes a whole input at once with the leaves spread over threads, zero meaning one per hardware thread.
+    static Digest digest(const void* input, size_t length, size_t threads = 0, size_t leafSize = DefaultLeafSize)
+    {
+        assert(leafSize);
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(input);
+        const size_t leafCount = length ? (length + leafSize - 1) / leafSize : 1;
+        std::vector<Digest> leaves(leafCount);
+        auto hashLeaf = [&](size_t i) {
+            const size_t begin = i * leafSize;
+            leaves[i] = leafHash(bytes + begin, std::min(leafSize, length - begin));
+        };
+        if (!threads)
+            threads = ThreadPool::defaultThreadCount();
+        if (threads > 1 && leafCount > 1) {
+            ThreadPool pool(std::min(threads, leafCount));
+            pool.parallelFor(leafCount, hashLeaf);
+        } else {
+            for (size_t i = 0; i < leafCount; ++i)
+                hashLeaf(i);
+        }
+        return root(leaves.data(), leafCount);
+    }
+
+    static Digest leafHash(const void* bytes, size_t length)
+    {
+        Hash hash;
+        hash.addBytes(&LeafPrefix, 1);
+        hash.addBytes(bytes, length);
+        return hash.digest();
+    }
+
+    static Digest node(const Digest& left, const Digest& right)
+    {
+        const auto leftBytes = digestBytes(left);
+        const auto rightBytes = digestBytes(right);
+        Hash hash;
+        hash.addBytes(&NodePrefix, 1);
+        hash.addBytes(leftBytes.data(), leftBytes.size());
+        hash.addBytes(rightBytes.data(), rightBytes.size());
+        return hash.digest();
+    }
+
+    // The root of the tree over count leaf hashes.
+    static Digest root(const Digest* leaves, size_t count)
+    {
+        assert(count);
+        if (count == 1)
+            return leaves[0];
+        size_t split = 1;
+        while (split * 2 < count)
+            split *= 2;
+        return node(root(leaves, split), root(leaves + split, count - split));
+    }
+
+private:
+    static constexpr uint8_t LeafPrefix = 0x00;
+    static constexpr uint8_t NodePrefix = 0x01;
+
+    struct Subtree {
+        Digest digest;
+        size_t leaves;
+    };
+
+    void startLeaf()
+    {
+        leaf = Hash();
+        leaf.addBytes(&LeafPrefix, 1);
+        leafBytes = 0;
+    }
+
+    void addLeaf(const Digest& digest)
+    {
+        subtrees.push_back({ digest, 1 });
+        while (subtrees.size() >= 2 && subtrees[subtrees.size() - 2].leaves == subtrees.back().leaves) {
+            Subtree right = subtrees.back();
+            subtrees.pop_back();
+            subtrees.back().digest = node(subtrees.back().digest, right.digest);
+            subtrees.back().leaves += right.leaves;
+        }
+    }
+
+    size_t leafSize;
+    Hash leaf;
+    size_t leafBytes { 0 };
+    std::vector<Subtree> subtrees;
+};
+
+template<typename Hash> constexpr uint8_t TreeHash<Hash>::LeafPrefix;
+template<typename Hash> constexpr uint8_t TreeHash<Hash>::NodePrefix;
+
+using SHA256Tree = TreeHash<SHA256>;
+using SHA512Tree = TreeHash<SHA512>;
+
+}
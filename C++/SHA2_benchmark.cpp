@@ -0,0 +1,266 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+// Measures the throughput of each SHA2 variant over message sizes from empty to 1 GiB,
+// hashing each message with the one-shot SHA2::digest, in one addBytes call, and in streams of smaller chunks.
+//
+// SHA2_benchmark [--format=text|csv|json] [--max-size=BYTES] [--min-time=SECONDS] [--variant=NAME] [--disable=sha,avx2,avx512] [--jit=scalar|bmi2|sha]
+//
+// csv and json (one object per line) are meant for comparing runs with a script.
+// --disable turns off instruction set extensions to compare kernels on one machine.
+// --jit hashes SHA-224 and SHA-256 with a kernel from SHA256Generator instead of the compiled ones.
+// It needs a 64-bit build with SHA2_BENCHMARK_JIT defined and the compiler's Assembler sources linked in.
+// Cycles are time stamp counter ticks, which run at a fixed rate that can differ from the core clock.
+
+#include "SHA2.h"
+#ifdef SHA2_BENCHMARK_JIT
+#include "SHA256Generator.h"
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined(SHA2_X86) && !defined(_MSC_VER)
+#include <x86intrin.h>
+#endif
+
+using SHA2::SHA224;
+using SHA2::SHA256;
+using SHA2::SHA314;
+using SHA2::SHA512;
+
+enum class Format { Text, CSV, JSON };
+
+struct Options {
+    Format format { Format::Text };
+    size_t maxSize { 1024 * 1024 * 1024 };
+    double minTime { 0.2 };
+    std::string variant;
+};
+
+struct Result {
+    const char* variant;
+    const char* mode;
+    size_t messageSize;
+    size_t chunkSize;
+    uint64_t messages;
+    double seconds;
+    double cycles;
+};
+
+static uint64_t readCycleCounter()
+{
+#ifdef SHA2_X86
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void printHeader(const Options& options)
+{
+    if (options.format == Format::CSV)
+        printf("variant,mode,message_bytes,chunk_bytes,messages,seconds,mb_per_second,cycles_per_byte,messages_per_second\n");
+    else if (options.format == Format::Text)
+        printf("%-7s %-9s %12s %10s %12s %10s %14s\n", "variant", "mode", "bytes", "chunk", "MB/s", "cycles/B", "messages/s");
+}
+
+static void printResult(const Options& options, const Result& result)
+{
+    const double bytes = static_cast<double>(result.messageSize) * result.messages;
+    const double megabytesPerSecond = bytes / result.seconds / 1e6;
+    // An empty message still costs a block, so its cycles are reported per message instead.
+    const double cyclesPerByte = result.cycles / (bytes ? bytes : result.messages);
+    const double messagesPerSecond = result.messages / result.seconds;
+    switch (options.format) {
+    case Format::CSV:
+        printf("%s,%s,%zu,%zu,%llu,%.6f,%.3f,%.3f,%.1f\n", result.variant, result.mode, result.messageSize, result.chunkSize,
+            static_cast<unsigned long long>(result.messages), result.seconds, megabytesPerSecond, cyclesPerByte, messagesPerSecond);
+        break;
+    case Format::JSON:
+        printf("{\"variant\":\"%s\",\"mode\":\"%s\",\"message_bytes\":%zu,\"chunk_bytes\":%zu,\"messages\":%llu,\"seconds\":%.6f,\"mb_per_second\":%.3f,\"cycles_per_byte\":%.3f,\"messages_per_second\":%.1f}\n",
+            result.variant, result.mode, result.messageSize, result.chunkSize, static_cast<unsigned long long>(result.messages),
+            result.seconds, megabytesPerSecond, cyclesPerByte, messagesPerSecond);
+        break;
+    case Format::Text:
+        printf("%-7s %-9s %12zu %10zu %12.1f %10.2f %14.0f\n", result.variant, result.mode, result.messageSize, result.chunkSize,
+            megabytesPerSecond, cyclesPerByte, messagesPerSecond);
+        break;
+    }
+    fflush(stdout);
+}
+
+// Keeps the compiler from removing hashes whose digests are never used.
+static volatile uint64_t digestSink;
+
+static const size_t OneShot = static_cast<size_t>(-1);
+
+template<typename Hash>
+static void hashMessage(const uint8_t* bytes, size_t length, size_t chunkSize)
+{
+    if (chunkSize == OneShot) {
+        digestSink = digestSink + Hash::digest(bytes, length)[0];
+        return;
+    }
+    Hash hash;
+    if (!chunkSize)
+        hash.addBytes(bytes, length);
+    else {
+        for (size_t offset = 0; offset < length; offset += chunkSize)
+            hash.addBytes(bytes + offset, std::min(chunkSize, length - offset));
+    }
+    digestSink = digestSink + hash.digest()[0];
+}
+
+// Hashes the message repeatedly, doubling the repetitions until they take at least minTime.
+template<typename Hash>
+static Result measure(const Options& options, const char* variant, const std::vector<uint8_t>& data, size_t messageSize, size_t chunkSize)
+{
+    const char* mode = chunkSize == OneShot ? "oneshot" : chunkSize ? "streaming" : "addbytes";
+    Result result = { variant, mode, messageSize, chunkSize == OneShot ? 0 : chunkSize, 0, 0, 0 };
+    for (uint64_t repetitions = 1; ; repetitions *= 2) {
+        const auto start = std::chrono::steady_clock::now();
+        const uint64_t startCycles = readCycleCounter();
+        for (uint64_t i = 0; i < repetitions; ++i)
+            hashMessage<Hash>(data.data(), messageSize, chunkSize);
+        result.cycles = static_cast<double>(readCycleCounter() - startCycles);
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.messages = repetitions;
+        if (result.seconds >= options.minTime)
+            return result;
+    }
+}
+
+template<typename Hash>
+static void benchmarkVariant(const Options& options, const char* variant, const std::vector<uint8_t>& data)
+{
+    if (!options.variant.empty() && options.variant != variant)
+        return;
+    const size_t chunkSizes[] = { 1, 13, Hash::BlockSizeBytes, 1000, 65536 };
+    for (size_t messageSize = 0; messageSize <= options.maxSize; messageSize = messageSize ? messageSize * 4 : 1) {
+        printResult(options, measure<Hash>(options, variant, data, messageSize, OneShot));
+        printResult(options, measure<Hash>(options, variant, data, messageSize, 0));
+        for (size_t chunkSize : chunkSizes) {
+            // Streaming one byte at a time through large messages would take minutes and says nothing new.
+            if (chunkSize < messageSize && messageSize / chunkSize <= 16 * 1024 * 1024)
+                printResult(options, measure<Hash>(options, variant, data, messageSize, chunkSize));
+        }
+    }
+}
+
+static bool installGeneratedKernel(const char* name)
+{
+#ifdef SHA2_BENCHMARK_JIT
+    using Compiler::SHA256Generator;
+    SHA256Generator::Kernel kernel;
+    if (!strcmp(name, "scalar"))
+        kernel = SHA256Generator::Scalar;
+    else if (!strcmp(name, "bmi2"))
+        kernel = SHA256Generator::ScalarBMI2;
+    else if (!strcmp(name, "sha"))
+        kernel = SHA256Generator::SHAExtensions;
+    else
+        return false;
+    // The generated code has to outlive every hash, so the generator is never destroyed.
+    SHA256Generator* generator = new SHA256Generator(kernel);
+    SHA2::customSHA256Compression() = generator->compressFunction();
+    return true;
+#else
+    (void)name;
+    fprintf(stderr, "--jit needs a build with SHA2_BENCHMARK_JIT\n");
+    return false;
+#endif
+}
+
+static bool parseOptions(int argc, const char** argv, Options& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        const char* argument = argv[i];
+        auto value = [argument](const char* name) -> const char* {
+            const size_t length = strlen(name);
+            return !strncmp(argument, name, length) ? argument + length : nullptr;
+        };
+        if (const char* format = value("--format=")) {
+            if (!strcmp(format, "text"))
+                options.format = Format::Text;
+            else if (!strcmp(format, "csv"))
+                options.format = Format::CSV;
+            else if (!strcmp(format, "json"))
+                options.format = Format::JSON;
+            else
+                return false;
+        } else if (const char* maxSize = value("--max-size="))
+            options.maxSize = strtoull(maxSize, nullptr, 10);
+        else if (const char* minTime = value("--min-time="))
+            options.minTime = atof(minTime);
+        else if (const char* variant = value("--variant="))
+            options.variant = variant;
+        else if (const char* disable = value("--disable=")) {
+            SHA2::CPUFeatures& features = SHA2::CPUFeatures::host();
+            features.sha = features.sha && !strstr(disable, "sha");
+            features.avx2 = features.avx2 && !strstr(disable, "avx2");
+            features.avx512 = features.avx512 && !strstr(disable, "avx512");
+        } else if (const char* kernel = value("--jit=")) {
+            if (!installGeneratedKernel(kernel))
+                return false;
+        } else
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, const char** argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        fprintf(stderr, "usage: %s [--format=text|csv|json] [--max-size=BYTES] [--min-time=SECONDS] [--variant=SHA224|SHA256|SHA384|SHA512] [--disable=sha,avx2,avx512] [--jit=scalar|bmi2|sha]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<uint8_t> data(options.maxSize);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 7 + (i >> 12));
+
+    const SHA2::CPUFeatures& features = SHA2::CPUFeatures::host();
+    if (options.format == Format::Text)
+        printf("extensions: sha %d, avx2 %d, avx512 %d%s\n", features.sha, features.avx2, features.avx512,
+            SHA2::customSHA256Compression() ? ", generated SHA-256 kernel" : "");
+    printHeader(options);
+    benchmarkVariant<SHA224>(options, "SHA224", data);
+    benchmarkVariant<SHA256>(options, "SHA256", data);
+    benchmarkVariant<SHA314>(options, "SHA384", data);
+    benchmarkVariant<SHA512>(options, "SHA512", data);
+    return 0;
+}
@@ -29,8 +29,22 @@ either expressed or implied, of the FreeBSD Project.
 *************************************************/
 
 #include "SHA2.h"
+#include "SHA2Checkpoint.h"
+#include "SHA2Chunker.h"
+#include "SHA2ContentStore.h"
+#include "SHA2File.h"
+#include "SHA2HMAC.h"
+#include "SHA2Manifest.h"
+#include "SHA2MerkleTree.h"
+#include "SHA2MultiBuffer.h"
+#include "SHA2Service.h"
+#include "SHA2Stream.h"
+#include "SHA2Tree.h"
+#include "ThreadPool.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <type_traits>
 #include <vector>
 
 using SHA2::SHA224;
@@ -68,6 +82,931 @@ bool largeTest() {
         && equalDigests(sha512.digest(), {0xb47c933421ea2db1, 0x49ad6e10fce6c7f9, 0x3d0752380180ffd7, 0xf4629a712134831d, 0x77be6091b819ed35, 0x2c2967a2e2d4fa50, 0x50723c9630691f1a, 0x05a7281dbe6c1086});
 }
 
+template<typename Hash, typename Batch>
+bool testBatch(const std::vector<uint8_t>& data)
+{
+    // Lengths around the padding boundaries, mixed with longer messages so lanes finish at different times.
+    std::vector<SHA2::Span> messages;
+    for (size_t length = 0; length < 300; ++length)
+        messages.push_back({ data.data() + length, length });
+    for (size_t length : { 1000, 4096, 100000, 55, 56, 111, 112 })
+        messages.push_back({ data.data(), length });
+
+    std::vector<typename Hash::Digest> digests(messages.size());
+    Batch::digest(messages.data(), messages.size(), digests.data());
+    for (size_t i = 0; i < messages.size(); ++i) {
+        Hash hash;
+        hash.addBytes(messages[i].data, messages[i].length);
+        if (!equalDigests(hash.digest(), digests[i]))
+            return false;
+    }
+    return true;
+}
+
+// Every combination of extensions, with batches on both sides of the sizes where the kernel changes.
+template<typename Hash>
+bool testBatchHash(const std::vector<uint8_t>& data)
+{
+    SHA2::CPUFeatures& features = SHA2::CPUFeatures::host();
+    const SHA2::CPUFeatures detected = features;
+    bool result = true;
+    for (unsigned disabled = 0; disabled < 8; ++disabled) {
+        features.sha = detected.sha && !(disabled & 1);
+        features.avx2 = detected.avx2 && !(disabled & 2);
+        features.avx512 = detected.avx512 && !(disabled & 4);
+        for (size_t count : { 1, 2, 7, 8, 20 }) {
+            std::vector<SHA2::Span> messages;
+            for (size_t i = 0; i < count; ++i)
+                messages.push_back({ data.data() + i, i * 97 % 700 });
+            std::vector<typename Hash::Digest> digests(count);
+            SHA2::BatchHash<Hash>::digest(messages.data(), count, digests.data());
+            for (size_t i = 0; i < count; ++i)
+                result = result && equalDigests(digests[i], Hash::digest(messages[i].data, messages[i].length));
+        }
+    }
+    features = detected;
+    return result;
+}
+
+bool testMultiBuffer()
+{
+    std::vector<uint8_t> data(200000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 7 + (i >> 8));
+
+    SHA2::CPUFeatures& features = SHA2::CPUFeatures::host();
+    const SHA2::CPUFeatures detected = features;
+    bool result = true;
+    for (bool avx2 : { detected.avx2, false }) {
+        features.avx2 = avx2;
+        result = result
+            && testBatch<SHA224, SHA2::SHA224x8>(data)
+            && testBatch<SHA256, SHA2::SHA256x8>(data);
+    }
+    for (bool avx512 : { detected.avx512, false }) {
+        features.avx512 = avx512;
+        result = result
+            && testBatch<SHA224, SHA2::SHA224x16>(data)
+            && testBatch<SHA256, SHA2::SHA256x16>(data)
+            && testBatch<SHA314, SHA2::SHA384x8>(data)
+            && testBatch<SHA512, SHA2::SHA512x8>(data);
+    }
+    features = detected;
+    return result
+        && testBatchHash<SHA224>(data)
+        && testBatchHash<SHA256>(data)
+        && testBatchHash<SHA314>(data)
+        && testBatchHash<SHA512>(data);
+}
+
+// The same messages must hash the same with and without each optional instruction set.
+template<typename Hash>
+bool testPortableFallback(const std::vector<uint8_t>& data, bool SHA2::CPUFeatures::* feature)
+{
+    SHA2::CPUFeatures& features = SHA2::CPUFeatures::host();
+    const SHA2::CPUFeatures detected = features;
+    for (size_t length = 0; length < data.size(); length += 1 + length / 4) {
+        features.*feature = detected.*feature;
+        Hash accelerated;
+        accelerated.addBytes(data.data(), length);
+        features.*feature = false;
+        Hash portable;
+        portable.addBytes(data.data(), length);
+        if (!equalDigests(accelerated.digest(), portable.digest())) {
+            features = detected;
+            return false;
+        }
+    }
+    features = detected;
+    return true;
+}
+
+bool testSHA256Extensions()
+{
+    std::vector<uint8_t> data(100000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 13 + (i >> 9));
+    return testPortableFallback<SHA224>(data, &SHA2::CPUFeatures::sha)
+        && testPortableFallback<SHA256>(data, &SHA2::CPUFeatures::sha);
+}
+
+bool testSHA512AVX2()
+{
+    std::vector<uint8_t> data(100000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 11 + (i >> 10));
+    return testPortableFallback<SHA314>(data, &SHA2::CPUFeatures::avx2)
+        && testPortableFallback<SHA512>(data, &SHA2::CPUFeatures::avx2);
+}
+
+bool testThreadPool()
+{
+    std::atomic<size_t> finished { 0 };
+    bool result = true;
+    {
+        SHA2::ThreadPool pool(4);
+        // Tasks posted from outside and from tasks, so workers both steal and run their own.
+        for (int round = 0; round < 20; ++round) {
+            finished = 0;
+            for (size_t i = 0; i < 100; ++i) {
+                pool.post([&] {
+                    for (size_t j = 0; j < 10; ++j)
+                        pool.post([&] { ++finished; });
+                    ++finished;
+                });
+            }
+            pool.wait();
+            result = result && finished == 1100;
+        }
+        pool.wait();
+
+        std::vector<size_t> squares(10000);
+        pool.parallelFor(squares.size(), [&](size_t i) { squares[i] = i * i; });
+        for (size_t i = 0; i < squares.size(); ++i)
+            result = result && squares[i] == i * i;
+
+        // Tasks still queued when the pool is destroyed are run first.
+        finished = 0;
+        for (size_t i = 0; i < 1000; ++i)
+            pool.post([&] { ++finished; });
+    }
+    return result && finished == 1000;
+}
+
+bool testTreeHash()
+{
+    using SHA2::SHA256Tree;
+    std::vector<uint8_t> data(10000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 5 + (i >> 7));
+
+    // Three leaves make a tree with two leaves on the left and one on the right.
+    const SHA256Tree::Digest expected = SHA256Tree::node(
+        SHA256Tree::node(SHA256Tree::leafHash(data.data(), 100), SHA256Tree::leafHash(data.data() + 100, 100)),
+        SHA256Tree::leafHash(data.data() + 200, 50));
+    SHA256Tree three(100);
+    three.addBytes(data.data(), 250);
+    if (!equalDigests(three.digest(), expected) || !equalDigests(SHA256Tree::digest(data.data(), 250, 2, 100), expected))
+        return false;
+
+    if (!equalDigests(SHA256Tree::digest(nullptr, 0, 1, 100), SHA256Tree::leafHash(nullptr, 0)))
+        return false;
+
+    for (size_t leafSize : { 64, 100, 1000 }) {
+        for (size_t length : { 0, 1, 63, 64, 65, 999, 1000, 1001, 4096, 10000 }) {
+            SHA256Tree incremental(leafSize);
+            for (size_t added = 0; added < length; added += 77)
+                incremental.addBytes(data.data() + added, std::min<size_t>(77, length - added));
+            const SHA256Tree::Digest digest = incremental.digest();
+            for (size_t threads : { 1, 3, 8 }) {
+                if (!equalDigests(digest, SHA256Tree::digest(data.data(), length, threads, leafSize)))
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool testHashFile()
+{
+    const char* path = "SHA2_test.tmp";
+    std::vector<uint8_t> data(300000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 3 + (i >> 11));
+
+    bool result = true;
+    for (size_t length : { 0, 1, 64, 65537, 300000 }) {
+        FILE* file = fopen(path, "wb");
+        if (!file)
+            return false;
+        fwrite(data.data(), 1, length, file);
+        fclose(file);
+
+        SHA256 expected;
+        expected.addBytes(data.data(), length);
+        SHA256::Digest digest;
+        // A small window makes the larger files take several mappings.
+        result = result
+            && SHA2::hashFile<SHA256>(path, digest, 65536)
+            && equalDigests(expected.digest(), digest);
+    }
+    remove(path);
+
+    SHA256::Digest digest;
+    return result && !SHA2::hashFile<SHA256>(path, digest);
+}
+
+bool testManifest()
+{
+    using Manifest = SHA2::Manifest<SHA256>;
+    std::vector<Manifest::Entry> entries;
+    size_t errorLine;
+    const std::string text = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad  abc.txt\r\n\n"
+        "BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD *name with spaces\n";
+    if (!Manifest::parse(text, entries, errorLine) || entries.size() != 2 || entries[1].path != "name with spaces")
+        return false;
+    if (!equalDigests(entries[0].digest, SHA256::digest("abc", 3)) || entries[1].digest != entries[0].digest)
+        return false;
+    if (Manifest::parse(text + "ba7816bf  short\n", entries, errorLine) || errorLine != 4)
+        return false;
+
+    // sha256sum escapes backslashes and newlines in names and marks those lines with a leading backslash.
+    const std::string escaped = "\\ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad  dir\\\\back\\nslash\\r\n";
+    entries.clear();
+    if (!Manifest::parse(escaped, entries, errorLine) || entries.size() != 1 || entries[0].path != "dir\\back\nslash\r"
+        || !equalDigests(entries[0].digest, SHA256::digest("abc", 3)))
+        return false;
+    if (Manifest::parse(escaped + "\\ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad  bad\\t\n", entries, errorLine) || errorLine != 2)
+        return false;
+    if (Manifest::parse("\\ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad  trailing\\\n", entries, errorLine) || errorLine != 1)
+        return false;
+
+    // Sizes on both sides of the small and large file limits below, one file changed after its digest was
+    // taken, and one missing.
+    std::vector<uint8_t> data(300000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 5 + (i >> 10));
+    const size_t sizes[] = { 0, 10, 999, 1000, 1001, 5000, 99999, 100000, 300000, 64, 65, 2000, 3000, 4000, 5000, 6000, 7000, 8000, 9000, 100 };
+    entries.clear();
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        const std::string path = "SHA2_test" + std::to_string(i) + ".tmp";
+        FILE* file = fopen(path.c_str(), "wb");
+        if (!file)
+            return false;
+        fwrite(data.data(), 1, sizes[i], file);
+        fclose(file);
+        entries.push_back({ path, SHA256::digest(data.data(), sizes[i]) });
+    }
+    entries[3].digest[0] ^= 1;
+    entries[8].digest[7] ^= 1;
+    entries.push_back({ "SHA2_test_missing.tmp", entries[0].digest });
+
+    SHA2::ManifestOptions options;
+    options.threads = 3;
+    options.smallFileSize = 1000;
+    options.largeFileSize = 100000;
+    options.windowSize = 65536;
+    size_t bytes = 0;
+    for (size_t size : sizes)
+        bytes += size;
+    SHA2::CPUFeatures& features = SHA2::CPUFeatures::host();
+    const SHA2::CPUFeatures detected = features;
+    bool result = true;
+    // Without the SHA extensions even small batches of files go through the lanes.
+    for (bool sha : { detected.sha, false }) {
+        features.sha = sha;
+        std::vector<Manifest::Status> statuses(entries.size(), Manifest::Status::Match);
+        size_t reported = 0;
+        const Manifest::Summary summary = Manifest::verify(entries, [&](const Manifest::Result& checked) {
+            statuses[checked.entry - entries.data()] = checked.status;
+            ++reported;
+        }, options);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const Manifest::Status expected = i == 3 || i == 8 ? Manifest::Status::Mismatch : i + 1 == entries.size() ? Manifest::Status::Unreadable : Manifest::Status::Match;
+            result = result && statuses[i] == expected;
+        }
+        result = result && reported == entries.size() && summary.files == entries.size()
+            && summary.mismatches == 2 && summary.unreadable == 1 && summary.bytes == bytes;
+    }
+    features = detected;
+    for (const Manifest::Entry& entry : entries)
+        remove(entry.path.c_str());
+    return result;
+}
+
+bool testContentStore()
+{
+    const char* path = "SHA2_test_store";
+    const std::string dataPath = std::string(path) + ".data";
+    const std::string indexPath = std::string(path) + ".index";
+    remove(dataPath.c_str());
+    remove(indexPath.c_str());
+
+    std::vector<uint8_t> data(5000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 13 + (i >> 7));
+    // Enough blobs to double the index several times, including an empty one.
+    const size_t blobCount = 3000;
+    auto blob = [&](size_t i) { return SHA2::Span { data.data() + i % 1000, i % 4000 }; };
+
+    bool result = true;
+    {
+        SHA2::ContentStore store;
+        SHA2::ContentStore reader;
+        SHA2::ContentStore secondWriter;
+        if (!store.open(path, true) || !reader.open(path, false) || secondWriter.open(path, true))
+            return false;
+        std::vector<SHA2::ContentStore::Digest> digests(blobCount);
+        std::atomic<size_t> stored { 0 };
+        bool readsMatched = true;
+        // A reader thread looks up blobs as soon as they are stored while the index grows underneath it.
+        std::thread readerThread([&] {
+            std::vector<uint8_t> bytes;
+            for (size_t i = 0; i < blobCount; ) {
+                if (i >= stored.load(std::memory_order_acquire))
+                    continue;
+                readsMatched = readsMatched && store.get(digests[i], bytes) && bytes.size() == blob(i).length
+                    && !memcmp(bytes.data(), blob(i).data, bytes.size());
+                ++i;
+            }
+        });
+        for (size_t i = 0; i < blobCount; ++i) {
+            result = result && store.put(blob(i).data, blob(i).length, digests[i]);
+            stored.store(i + 1, std::memory_order_release);
+        }
+        readerThread.join();
+        result = result && readsMatched;
+
+        SHA2::ContentStore::Digest digest;
+        result = result && store.size() == blobCount && store.put(blob(7).data, blob(7).length, digest) && store.size() == blobCount
+            && equalDigests(digest, digests[7]) && store.flush();
+
+        // A reader that opened the store before it grew sees only older blobs until it refreshes.
+        std::vector<uint8_t> bytes;
+        result = result && reader.contains(digests[0]) && !reader.contains(digests[blobCount - 1])
+            && reader.refresh() && reader.get(digests[blobCount - 1], bytes) && bytes.size() == blob(blobCount - 1).length;
+        digest[0] ^= 1;
+        result = result && !store.contains(digest) && !store.get(digest, bytes);
+    }
+
+    // Reopening maps the index that was written instead of rebuilding it.
+    SHA2::ContentStore reopened;
+    std::vector<uint8_t> bytes;
+    result = result && reopened.open(path, false) && reopened.size() == blobCount;
+    for (size_t i = 0; i < blobCount && result; i += 97)
+        result = reopened.get(SHA256::digest(blob(i).data, blob(i).length), bytes) && bytes.size() == blob(i).length;
+
+    // Corrupt bytes fail the digest check, and a corrupt length is caught before anything is read.
+    const auto firstBlob = SHA256::digest(blob(1).data, blob(1).length);
+    if (FILE* file = fopen(dataPath.c_str(), "r+b")) {
+        const uint8_t flipped = data[1] ^ 1;
+        result = result && fwrite(&flipped, 1, 1, file) == 1;
+        fclose(file);
+        result = result && !reopened.get(firstBlob, bytes);
+    } else
+        result = false;
+    if (FILE* file = fopen(indexPath.c_str(), "r+b")) {
+        fseek(file, 0, SEEK_END);
+        std::vector<uint8_t> index(static_cast<size_t>(ftell(file)));
+        result = result && !fseek(file, 0, SEEK_SET) && fread(index.data(), index.size(), 1, file) == 1;
+        for (size_t slot = 64; slot + 48 <= index.size(); slot += 48) {
+            uint64_t published;
+            memcpy(&published, &index[slot + 40], sizeof(published));
+            if (published) {
+                published = uint64_t(1) << 60;
+                memcpy(&index[slot + 40], &published, sizeof(published));
+            }
+        }
+        result = result && !fseek(file, 0, SEEK_SET) && fwrite(index.data(), index.size(), 1, file) == 1;
+        fclose(file);
+        SHA2::ContentStore corrupt;
+        result = result && corrupt.open(path, false) && corrupt.contains(SHA256::digest(blob(2).data, blob(2).length))
+            && !corrupt.get(SHA256::digest(blob(2).data, blob(2).length), bytes);
+    } else
+        result = false;
+
+    // A corrupt index with no empty slot answers lookups instead of probing forever.
+    if (FILE* file = fopen(indexPath.c_str(), "wb")) {
+        uint8_t index[64 + 2 * 48] = { 'S', 'H', 'A', '2', 'C', 'A', 'S' };
+        const uint32_t version = 1;
+        const uint32_t slotBits = 1;
+        const uint64_t count = 2;
+        const uint64_t published = 1;
+        memcpy(index + 8, &version, sizeof(version));
+        memcpy(index + 12, &slotBits, sizeof(slotBits));
+        memcpy(index + 16, &count, sizeof(count));
+        for (size_t slot = 0; slot < 2; ++slot)
+            memcpy(index + 64 + slot * 48 + 40, &published, sizeof(published));
+        result = result && fwrite(index, sizeof(index), 1, file) == 1;
+        fclose(file);
+        SHA2::ContentStore corrupt;
+        result = result && corrupt.open(path, false) && !corrupt.contains(SHA256::digest(blob(1).data, blob(1).length));
+    } else
+        result = false;
+
+    // A writer leaves an index it can't open alone instead of replacing it with an empty one.
+    if (FILE* file = fopen(indexPath.c_str(), "wb")) {
+        result = result && fwrite("junk", 4, 1, file) == 1;
+        fclose(file);
+        SHA2::ContentStore writer;
+        char contents[8] = { };
+        result = result && !writer.open(path, true);
+        file = fopen(indexPath.c_str(), "rb");
+        result = result && file && fread(contents, 1, sizeof(contents), file) == 4 && !memcmp(contents, "junk", 4);
+        if (file)
+            fclose(file);
+    } else
+        result = false;
+
+    remove(dataPath.c_str());
+    remove(indexPath.c_str());
+    return result;
+}
+
+bool testStreams()
+{
+    std::vector<uint8_t> data(100000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 29 + (i >> 4));
+
+    // Reads of odd sizes, ending on and between buffer boundaries, through a small ring of buffers.
+    bool result = true;
+    for (size_t length : { 0, 1, 4096, 3 * 4096, 100000 }) {
+        size_t offset = 0;
+        size_t step = 0;
+        SHA512::Digest digest;
+        result = result && SHA2::hashStream<SHA512>([&](uint8_t* buffer, size_t size) -> ptrdiff_t {
+            const size_t count = std::min({ size, length - offset, ++step % 3000 + 1 });
+            memcpy(buffer, data.data() + offset, count);
+            offset += count;
+            return static_cast<ptrdiff_t>(count);
+        }, digest, 4096, 2) && equalDigests(digest, SHA512::digest(data.data(), length));
+    }
+
+    // A read error is reported once the bytes before it are hashed, without a digest.
+    size_t reads = 0;
+    SHA256::Digest digest;
+    result = result && !SHA2::hashStream<SHA256>([&](uint8_t* buffer, size_t size) -> ptrdiff_t {
+        if (++reads == 20)
+            return -1;
+        memset(buffer, 0, std::min<size_t>(size, 1000));
+        return static_cast<ptrdiff_t>(std::min<size_t>(size, 1000));
+    }, digest, 4096);
+
+#ifndef _WIN32
+    int pipeEnds[2];
+    if (pipe(pipeEnds))
+        return false;
+    bool written = true;
+    std::thread writer([&] {
+        for (size_t offset = 0; offset < data.size(); offset += 7777)
+            written = write(pipeEnds[1], data.data() + offset, std::min<size_t>(7777, data.size() - offset)) > 0 && written;
+        close(pipeEnds[1]);
+    });
+    const bool hashed = SHA2::hashStream<SHA256>(pipeEnds[0], digest, 16384);
+    writer.join();
+    close(pipeEnds[0]);
+    result = result && written && hashed && equalDigests(digest, SHA256::digest(data.data(), data.size()));
+#endif
+    return result;
+}
+
+bool testSegments()
+{
+    std::vector<uint8_t> data(5000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 17 + (i >> 6));
+
+    SHA512 whole;
+    whole.addBytes(data.data(), data.size());
+    const SHA512::Digest expected = whole.digest();
+
+    // Segment lengths that start, end, and fill blocks at different offsets, including empty ones.
+    for (size_t step : { 1, 13, 64, 127, 128, 129, 1000 }) {
+        std::vector<SHA2::Span> segments;
+        for (size_t offset = 0, i = 0; offset < data.size(); ++i) {
+            const size_t length = std::min(data.size() - offset, step * (i % 3));
+            segments.push_back({ data.data() + offset, length });
+            offset += length;
+        }
+        SHA512 scattered;
+        scattered.addSegments(segments.data(), segments.size());
+        if (!equalDigests(scattered.digest(), expected))
+            return false;
+    }
+
+    // Empty input through either call is the empty message, and neither call is ambiguous with a null pointer.
+    SHA512 empty;
+    empty.addBytes(nullptr, 0);
+    empty.addSegments(nullptr, 0);
+    return equalDigests(empty.digest(), SHA512::digest(nullptr, 0));
+}
+
+template<typename Hash>
+bool testMidstate(const std::vector<uint8_t>& data)
+{
+    static_assert(std::is_trivially_copyable<typename Hash::Midstate>::value, "midstates are copied as plain bytes");
+    for (size_t prefixLength : { 0, 1, 63, 64, 100, 128, 200 }) {
+        Hash prefix;
+        prefix.addBytes(data.data(), prefixLength);
+        const typename Hash::Midstate midstate = prefix.midstate();
+        for (size_t suffixLength : { 0, 1, 55, 64, 300 }) {
+            Hash resumed(midstate);
+            resumed.addBytes(data.data() + prefixLength, suffixLength);
+            Hash whole;
+            whole.addBytes(data.data(), prefixLength + suffixLength);
+            if (!equalDigests(resumed.digest(), whole.digest()))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool testMidstates()
+{
+    std::vector<uint8_t> data(500);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 29);
+    return testMidstate<SHA224>(data)
+        && testMidstate<SHA256>(data)
+        && testMidstate<SHA314>(data)
+        && testMidstate<SHA512>(data);
+}
+
+template<typename Hash, typename Other>
+bool testCheckpoint(const std::vector<uint8_t>& data)
+{
+    using Checkpoint = SHA2::Checkpoint<Hash>;
+    for (size_t prefixLength : { 0, 1, 63, 64, 100, 127, 200 }) {
+        Hash prefix;
+        prefix.addBytes(data.data(), prefixLength);
+        const std::vector<uint8_t> checkpoint = Checkpoint::serialize(prefix.midstate());
+        if (checkpoint.size() > Checkpoint::MaximumSize)
+            return false;
+        typename Hash::Midstate midstate;
+        if (!Checkpoint::deserialize(checkpoint.data(), checkpoint.size(), midstate) || midstate.length != prefixLength)
+            return false;
+        Hash resumed(midstate);
+        resumed.addBytes(data.data() + prefixLength, data.size() - prefixLength);
+        if (!equalDigests(resumed.digest(), Hash::digest(data.data(), data.size())))
+            return false;
+
+        // Damaged, truncated and foreign checkpoints are rejected.
+        typename Other::Midstate otherMidstate;
+        if (SHA2::Checkpoint<Other>::deserialize(checkpoint.data(), checkpoint.size(), otherMidstate)
+            || Checkpoint::deserialize(checkpoint.data(), checkpoint.size() - 1, midstate))
+            return false;
+        for (size_t i = 0; i < checkpoint.size(); ++i) {
+            std::vector<uint8_t> damaged = checkpoint;
+            damaged[i] ^= 0x10;
+            if (Checkpoint::deserialize(damaged.data(), damaged.size(), midstate))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool testCheckpoints()
+{
+    std::vector<uint8_t> data(1000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 37 + 5);
+    return testCheckpoint<SHA224, SHA256>(data)
+        && testCheckpoint<SHA256, SHA224>(data)
+        && testCheckpoint<SHA314, SHA512>(data)
+        && testCheckpoint<SHA512, SHA256>(data);
+}
+
+static size_t customCompressionBlocks = 0;
+
+// Counts the blocks and compresses them with the built-in kernels through a midstate.
+static void countingCompression(uint32_t* state, const uint8_t* blocks, size_t count)
+{
+    customCompressionBlocks += count;
+    SHA2::customSHA256Compression() = nullptr;
+    SHA256::Midstate midstate = { };
+    std::copy(state, state + 8, midstate.state.begin());
+    SHA256 hash(midstate);
+    hash.addBytes(blocks, count * SHA256::BlockSizeBytes);
+    const SHA256::Midstate compressed = hash.midstate();
+    std::copy(compressed.state.begin(), compressed.state.end(), state);
+    SHA2::customSHA256Compression() = countingCompression;
+}
+
+bool testCustomCompression()
+{
+    std::vector<uint8_t> data(1000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 13);
+    const SHA256::Digest expected = SHA256::digest(data.data(), data.size());
+    const SHA224::Digest expected224 = SHA224::digest(data.data(), data.size());
+    const SHA512::Digest expected512 = SHA512::digest(data.data(), data.size());
+
+    SHA2::customSHA256Compression() = countingCompression;
+    SHA256 hash;
+    hash.addBytes(data.data(), 100);
+    hash.addBytes(data.data() + 100, data.size() - 100);
+    const bool matched = equalDigests(hash.digest(), expected)
+        && equalDigests(SHA224::digest(data.data(), data.size()), expected224)
+        && equalDigests(SHA512::digest(data.data(), data.size()), expected512);
+    SHA2::customSHA256Compression() = nullptr;
+
+    // SHA-512 keeps its own kernels, and each SHA-224 and SHA-256 message is 16 blocks with its padding.
+    return matched && customCompressionBlocks == 2 * 16;
+}
+
+bool testInstrumentation()
+{
+    std::vector<uint8_t> data(1000, 1);
+    SHA2::resetStatistics();
+    SHA256 hash;
+    hash.addBytes(data.data(), 10);
+    hash.addBytes(data.data() + 10, data.size() - 10);
+    hash.digest();
+    SHA256::digest(data.data(), 100);
+    const SHA2::Statistics statistics = SHA2::statistics();
+#ifdef SHA2_INSTRUMENTATION
+    // The streamed message is 16 blocks with its padding and the one-shot message is 2.
+    if (!statistics.enabled || statistics.bytes != 1100 || statistics.blocks != 18 || !statistics.compressionNanoseconds
+        || (statistics.hardwareCounters && (!statistics.cycles || !statistics.instructions)))
+        return false;
+    // Counts from a thread stay in the totals after it exits.
+    std::thread([&data] { SHA256::digest(data.data(), 64); }).join();
+    const SHA2::Statistics afterThread = SHA2::statistics();
+    return afterThread.bytes == 1164 && afterThread.blocks == 20;
+#else
+    return !statistics.enabled && !statistics.bytes && !statistics.blocks;
+#endif
+}
+
+template<size_t Size>
+bool equalBytes(const uint8_t* bytes, const char* hex)
+{
+    for (size_t i = 0; i < Size; ++i) {
+        unsigned value;
+        if (sscanf(hex + 2 * i, "%2x", &value) != 1 || bytes[i] != value)
+            return false;
+    }
+    return true;
+}
+
+template<typename Hash, size_t Size>
+bool testPBKDF2(const char* password, const char* salt, size_t iterations, const char* expected)
+{
+    uint8_t output[Size];
+    SHA2::PBKDF2<Hash>::derive(password, strlen(password), salt, strlen(salt), iterations, output, Size);
+    return equalBytes<Size>(output, expected);
+}
+
+bool testHMAC()
+{
+    const char* jefe = "Jefe";
+    const char* question = "what do ya want for nothing?";
+    std::vector<uint8_t> longKey(131, 0xaa);
+    const char* longKeyMessage = "Test Using Larger Than Block-Size Key - Hash Key First";
+    SHA2::HMAC<SHA256> hmac256(jefe, strlen(jefe));
+    if (!equalDigests(hmac256.digest(question, strlen(question)), {0x5bdcc146, 0xbf60754e, 0x6a042426, 0x089575c7, 0x5a003f08, 0x9d273983, 0x9dec58b9, 0x64ec3843})
+        || !equalDigests(SHA2::HMAC<SHA224>(jefe, strlen(jefe)).digest(question, strlen(question)), {0xa30e0109, 0x8bc6dbbf, 0x45690f3a, 0x7e9e6d0f, 0x8bbea2a3, 0x9e614800, 0x8fd05e44})
+        || !equalDigests(SHA2::HMAC<SHA314>(jefe, strlen(jefe)).digest(question, strlen(question)), {0xaf45d2e376484031, 0x617f78d2b58a6b1b, 0x9c7ef464f5a01b47, 0xe42ec3736322445e, 0x8e2240ca5e69e2c7, 0x8b3239ecfab21649})
+        || !equalDigests(SHA2::HMAC<SHA512>(longKey.data(), longKey.size()).digest(longKeyMessage, strlen(longKeyMessage)), {0x80b24263c7c1a3eb, 0xb71493c1dd7be8b4, 0x9b46d1f41b4aeec1, 0x121b013783f8f352, 0x6b56d037e05f2598, 0xbd0fd2215d6a1e52, 0x95e64f73f63f0aec, 0x8b915a985d786598}))
+        return false;
+
+    SHA256 pieces = hmac256.begin();
+    pieces.addBytes(question, 10);
+    pieces.addBytes(question + 10, strlen(question) - 10);
+    if (!equalDigests(hmac256.finish(pieces), hmac256.digest(question, strlen(question))))
+        return false;
+
+    // RFC 5869 test case 1
+    std::vector<uint8_t> inputKey(22, 0x0b);
+    uint8_t salt[13];
+    uint8_t info[10];
+    for (size_t i = 0; i < sizeof(salt); ++i)
+        salt[i] = static_cast<uint8_t>(i);
+    for (size_t i = 0; i < sizeof(info); ++i)
+        info[i] = static_cast<uint8_t>(0xf0 + i);
+    const SHA256::Digest pseudorandomKey = SHA2::HKDF<SHA256>::extract(salt, sizeof(salt), inputKey.data(), inputKey.size());
+    uint8_t outputKey[42];
+    if (!equalDigests(pseudorandomKey, {0x07770936, 0x2c2e32df, 0x0ddc3f0d, 0xc47bba63, 0x90b6c73b, 0xb50f9c31, 0x22ec844a, 0xd7c2b3e5})
+        || !SHA2::HKDF<SHA256>::expand(pseudorandomKey, info, sizeof(info), outputKey, sizeof(outputKey))
+        || !equalBytes<42>(outputKey, "3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5db02d56ecc4c5bf34007208d5b887185865")
+        || SHA2::HKDF<SHA256>::expand(pseudorandomKey, info, sizeof(info), outputKey, 255 * 32 + 1))
+        return false;
+
+    SHA2::CPUFeatures& features = SHA2::CPUFeatures::host();
+    const SHA2::CPUFeatures detected = features;
+    bool result = true;
+    // With AVX2, multi-block SHA-224 and SHA-256 outputs go through the multi-buffer lanes.
+    for (bool avx2 : { detected.avx2, false }) {
+        features.avx2 = avx2;
+        result = result
+            && testPBKDF2<SHA256, 64>("passwd", "salt", 1, "55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783")
+            && testPBKDF2<SHA256, 64>("Password", "NaCl", 80000, "4ddcd8f60b98be21830cee5ef22701f9641a4418d04c0414aeff08876b34ab56a1d425a1225833549adb841b51c9b3176a272bdebba1d078478f62b397f33c8d")
+            && testPBKDF2<SHA224, 100>("password", "salt", 4096, "218c453bf90635bd0a21a75d172703ff6108ef603f65bb821aedade1d6961683ba8f67877d2a3f738cd98905b2cabdb82efaa223b3b438ed1d3a2e9758aa92b99f20728f210fb9af3818a873090326f338c9b4655f7beaf0ffbf5894f6566ecc243a8b40")
+            && testPBKDF2<SHA512, 150>("password", "salt", 10, "ded5fd36ace28019108070acb5acc9db892eb04230f71ecda77c0dbf97e38a8dd7cd384c0b3a5a903fa8137516563d12c6666db019ef7781ef996b4fcd6b62caa1f61ea7c9b8a54e67973b30014c3a33d9f7a38c63bd268de6432eebc086b969b705105255264b1b83dbbd053190a8702d06074389c889e8750efc4aecb1d4c790996e814ed6934856bb42dbf633fce24faacd49df15");
+    }
+    features = detected;
+    return result;
+}
+
+bool testConstexprDigest()
+{
+    constexpr SHA256::Digest abc = SHA256::constexprDigest("abc");
+    static_assert(abc[0] == 0xba7816bf && abc[7] == 0xf20015ad, "SHA-256 runs in constant expressions");
+    constexpr SHA314::Digest empty = SHA314::constexprDigest("");
+    static_assert(empty[0] == 0x38b060a751ac9638 && empty[5] == 0xd51ad2f14898b95b, "SHA-384 runs in constant expressions");
+
+    std::vector<uint8_t> data(300);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 31);
+    for (size_t length = 0; length < data.size(); ++length) {
+        SHA224 sha224;
+        sha224.addBytes(data.data(), length);
+        SHA512 sha512;
+        sha512.addBytes(data.data(), length);
+        if (!equalDigests(sha224.digest(), SHA224::constexprDigest(data.data(), length))
+            || !equalDigests(sha512.digest(), SHA512::constexprDigest(data.data(), length)))
+            return false;
+    }
+    return true;
+}
+
+template<typename Hash>
+bool testOneShot(const std::vector<uint8_t>& data)
+{
+    for (size_t length = 0; length < data.size(); ++length) {
+        Hash hash;
+        hash.addBytes(data.data(), length);
+        if (!equalDigests(hash.digest(), Hash::digest(data.data(), length)))
+            return false;
+    }
+    return true;
+}
+
+bool testOneShots()
+{
+    std::vector<uint8_t> data(600);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 37 + 5);
+    return testOneShot<SHA224>(data)
+        && testOneShot<SHA256>(data)
+        && testOneShot<SHA314>(data)
+        && testOneShot<SHA512>(data);
+}
+
+template<typename Hash>
+bool testHashingService(const std::vector<uint8_t>& data)
+{
+    SHA2::HashingService<Hash> service(3);
+    const size_t streamCount = 20;
+    std::vector<typename SHA2::HashingService<Hash>::StreamID> streams;
+    std::vector<size_t> added(streamCount);
+    for (size_t i = 0; i < streamCount; ++i)
+        streams.push_back(service.open());
+
+    // Interleave chunks of odd sizes across the streams; stream i ends after 150 * i bytes.
+    for (size_t round = 0; round < 40; ++round) {
+        for (size_t i = 0; i < streamCount; ++i) {
+            const size_t length = std::min((round * 7 + i * 13) % 97 + 1, 150 * i - std::min(150 * i, added[i]));
+            if (length)
+                service.addBytes(streams[i], data.data() + added[i], length);
+            added[i] += length;
+        }
+    }
+
+    std::vector<std::future<typename Hash::Digest>> futures;
+    typename Hash::Digest callbackDigest;
+    std::promise<void> callbackCalled;
+    for (size_t i = 0; i < streamCount; ++i) {
+        if (i == 5)
+            service.finish(streams[i], [&](const typename Hash::Digest& digest) { callbackDigest = digest; callbackCalled.set_value(); });
+        else
+            futures.push_back(service.finish(streams[i]));
+    }
+    callbackCalled.get_future().wait();
+    if (!equalDigests(callbackDigest, Hash::digest(data.data(), added[5])))
+        return false;
+    for (size_t i = 0, future = 0; i < streamCount; ++i) {
+        if (i != 5 && !equalDigests(futures[future++].get(), Hash::digest(data.data(), added[i])))
+            return false;
+    }
+    return true;
+}
+
+bool testHashingServices()
+{
+    std::vector<uint8_t> data(3000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 19 + (i >> 5));
+
+    SHA2::CPUFeatures& features = SHA2::CPUFeatures::host();
+    const SHA2::CPUFeatures detected = features;
+    bool result = true;
+    // Without the SHA extensions, SHA-256 streams share the AVX2 lanes.
+    for (bool sha : { detected.sha, false }) {
+        features.sha = sha;
+        result = result
+            && testHashingService<SHA256>(data)
+            && testHashingService<SHA512>(data);
+    }
+    features = detected;
+    return result;
+}
+
+bool testChunks(const std::vector<SHA2::SHA256Chunker::Chunk>& chunks, const std::vector<uint8_t>& data, const SHA2::SHA256Chunker::Parameters& parameters)
+{
+    uint64_t offset = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (chunks[i].offset != offset || chunks[i].length > parameters.maximumSize)
+            return false;
+        if (i + 1 < chunks.size() && chunks[i].length < parameters.minimumSize)
+            return false;
+        if (!equalDigests(chunks[i].digest, SHA256::digest(data.data() + offset, chunks[i].length)))
+            return false;
+        offset += chunks[i].length;
+    }
+    return offset == data.size();
+}
+
+bool testContentDefinedChunking()
+{
+    std::vector<uint8_t> data(1 << 20);
+    uint64_t random = 1;
+    for (uint8_t& byte : data) {
+        random = random * 6364136223846793005ull + 1442695040888963407ull;
+        byte = static_cast<uint8_t>(random >> 56);
+    }
+    const SHA2::SHA256Chunker::Parameters parameters { 1024, 4096, 16384 };
+    const auto chunks = SHA2::SHA256Chunker::chunks(data.data(), data.size(), parameters);
+    if (chunks.size() < data.size() / 16384 || !testChunks(chunks, data, parameters))
+        return false;
+    if (!SHA2::SHA256Chunker::chunks(data.data(), 0).empty())
+        return false;
+
+    // Adding the input in odd pieces finds the same chunks.
+    std::vector<SHA2::SHA256Chunker::Chunk> pieces;
+    SHA2::SHA256Chunker chunker([&](const SHA2::SHA256Chunker::Chunk& chunk) { pieces.push_back(chunk); }, parameters);
+    for (size_t offset = 0, length = 1; offset < data.size(); offset += length, length = length * 3 % 5000 + 1)
+        chunker.addBytes(data.data() + offset, std::min(length, data.size() - offset));
+    chunker.finish();
+    if (pieces.size() != chunks.size())
+        return false;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (pieces[i].length != chunks[i].length || !equalDigests(pieces[i].digest, chunks[i].digest))
+            return false;
+    }
+
+    // Inserting one byte only changes the chunks around it.
+    std::vector<uint8_t> edited(data);
+    edited.insert(edited.begin() + 500000, 0x55);
+    const auto editedChunks = SHA2::SHA256Chunker::chunks(edited.data(), edited.size(), parameters);
+    if (!testChunks(editedChunks, edited, parameters))
+        return false;
+    size_t shared = 0;
+    for (const auto& chunk : editedChunks) {
+        for (const auto& original : chunks) {
+            if (equalDigests(chunk.digest, original.digest)) {
+                ++shared;
+                break;
+            }
+        }
+    }
+    return shared + 3 >= chunks.size();
+}
+
+bool testMerkleTree()
+{
+    const size_t leafSize = 1000;
+    std::vector<uint8_t> data(101 * leafSize - 300);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 11 + (i >> 9));
+    SHA2::SHA256MerkleTree tree = SHA2::SHA256MerkleTree::fromData(data.data(), data.size(), leafSize);
+    if (!equalDigests(tree.root(), SHA2::SHA256Tree::digest(data.data(), data.size(), 1, leafSize)))
+        return false;
+
+    // Changing a few leaves, two of them under the same parent, rehashes to the root of the changed data.
+    for (size_t index : { 6, 7, 50, 100 }) {
+        data[index * leafSize] ^= 1;
+        tree.setLeafData(index, data.data() + index * leafSize, std::min(leafSize, data.size() - index * leafSize));
+    }
+    if (!equalDigests(tree.commit(), SHA2::SHA256Tree::digest(data.data(), data.size(), 1, leafSize)))
+        return false;
+
+    for (size_t index = 0; index < tree.leafCount(); ++index) {
+        auto proof = tree.proof(index);
+        if (!SHA2::SHA256MerkleTree::verify(tree.leaf(index), proof, tree.root()))
+            return false;
+        // The last leaf of an odd level has no sibling.
+        if ((index ^ 1) < tree.leafCount() && SHA2::SHA256MerkleTree::verify(tree.leaf(index ^ 1), proof, tree.root()))
+            return false;
+        proof.siblings.back()[0] ^= 1;
+        if (SHA2::SHA256MerkleTree::verify(tree.leaf(index), proof, tree.root()))
+            return false;
+    }
+
+    // Growing and shrinking keep the root equal to a tree hash of the whole data.
+    for (size_t length : { data.size() + 3 * leafSize, size_t(64 * leafSize), size_t(5 * leafSize), size_t(3 * leafSize + 1), size_t(129 * leafSize) }) {
+        const size_t oldCount = tree.leafCount();
+        const size_t oldLength = data.size();
+        data.resize(length, 0x5A);
+        tree.resize((length + leafSize - 1) / leafSize);
+        for (size_t index = std::min(oldCount, tree.leafCount()) - 1; index < tree.leafCount(); ++index) {
+            if (index * leafSize >= std::min(oldLength, length) - std::min(oldLength, length) % leafSize)
+                tree.setLeafData(index, data.data() + index * leafSize, std::min(leafSize, length - index * leafSize));
+        }
+        if (!equalDigests(tree.commit(), SHA2::SHA256Tree::digest(data.data(), data.size(), 1, leafSize)))
+            return false;
+    }
+
+    const std::vector<uint8_t> bytes = tree.serialize();
+    SHA2::SHA256MerkleTree copy;
+    if (copy.deserialize(bytes.data(), bytes.size() - 1) || !copy.deserialize(bytes.data(), bytes.size()))
+        return false;
+    return copy.leafCount() == tree.leafCount()
+        && equalDigests(copy.root(), tree.root())
+        && copy.serialize() == bytes;
+}
+
 bool testSHA2()
 {
     auto sha224digest = [](const char* string) { SHA224 sha224; sha224.addBytes(string, strlen(string)); return sha224.digest(); };
@@ -91,6 +1030,11 @@ bool testSHA2()
     if (!equalDigests(sha256digest("abc"), buffer.digest()))
         return false;
         
+    // 55 bytes is the longest message whose padding fits in one block.
+    const char* a55 = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+    if (!equalDigests(sha256digest(a55), {0x9f4390f8, 0xd30c2dd9, 0x2ec9f095, 0xb65e2b9a, 0xe9b0a925, 0xa5258e24, 0x1c9f1e91, 0x0f734318}))
+        return false;
+
     std::vector<size_t> sizes = {1, 7, 32, 64, 128, 127, 255, 256, 257, 6040, 1542, 100000, 555555};
     for (size_t adding : sizes) {
         SHA256 buffer;
@@ -128,6 +1072,26 @@ bool testSHA2()
         && equalDigests(sha512digest("abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu"), {0x8e959b75dae313da, 0x8cf4f72814fc143f, 0x8f7779c6eb9f7fa1, 0x7299aeadb6889018, 0x501d289e4900f7e4, 0x331b99dec4b5433a, 0xc7d329eeb6dd2654, 0x5e96e55b874be909})
         && equalDigests(sha512.digest(), {0xe718483d0ce76964, 0x4e2e42c7bc15b463, 0x8e1f98b13b204428, 0x5632a803afa973eb, 0xde0ff244877ea60a, 0x4cb0432ce577c31b, 0xeb009c5c2c49aa2e, 0x4eadb217ad8cc09b})
 
+        && testMultiBuffer()
+        && testSHA256Extensions()
+        && testSHA512AVX2()
+        && testThreadPool()
+        && testTreeHash()
+        && testHashFile()
+        && testManifest()
+        && testContentStore()
+        && testStreams()
+        && testSegments()
+        && testMidstates()
+        && testCheckpoints()
+        && testCustomCompression()
+        && testInstrumentation()
+        && testHMAC()
+        && testConstexprDigest()
+        && testOneShots()
+        && testHashingServices()
+        && testContentDefinedChunking()
+        && testMerkleTree()
         && largeTest();
 }
 
@@ -0,0 +1,162 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+// Checks files against a digest manifest in the format written by sha256sum and its siblings,
+// hashing many files at once on all cores. The algorithm follows from the length of the digests.
+//
+// SHA2_verify [--threads=N] [--quiet] [--disable=sha,avx2,avx512] MANIFEST
+//
+// Like sha256sum -c it prints "path: OK" or "path: FAILED" for each file as it is checked;
+// --quiet leaves out the files that match. Progress and a throughput summary go to stderr.
+// Exits with 1 if any file does not match or cannot be read, and 2 if the manifest cannot be.
+
+#include "SHA2Manifest.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+struct Options {
+    SHA2::ManifestOptions manifest;
+    bool quiet { false };
+    const char* path { nullptr };
+};
+
+static bool parseOptions(int argc, const char** argv, Options& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        const char* argument = argv[i];
+        auto value = [argument](const char* name) -> const char* {
+            const size_t length = strlen(name);
+            return !strncmp(argument, name, length) ? argument + length : nullptr;
+        };
+        if (const char* threads = value("--threads="))
+            options.manifest.threads = strtoul(threads, nullptr, 10);
+        else if (!strcmp(argument, "--quiet"))
+            options.quiet = true;
+        else if (const char* disable = value("--disable=")) {
+            SHA2::CPUFeatures& features = SHA2::CPUFeatures::host();
+            features.sha = features.sha && !strstr(disable, "sha");
+            features.avx2 = features.avx2 && !strstr(disable, "avx2");
+            features.avx512 = features.avx512 && !strstr(disable, "avx512");
+        } else if (argument[0] != '-' && !options.path)
+            options.path = argument;
+        else
+            return false;
+    }
+    return options.path;
+}
+
+static bool readFile(const char* path, std::string& text)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+    char buffer[65536];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)))
+        text.append(buffer, read);
+    const bool result = !ferror(file);
+    fclose(file);
+    return result;
+}
+
+template<typename Hash>
+static int verify(const Options& options, const std::string& text)
+{
+    using Manifest = SHA2::Manifest<Hash>;
+    std::vector<typename Manifest::Entry> entries;
+    size_t errorLine;
+    if (!Manifest::parse(text, entries, errorLine)) {
+        fprintf(stderr, "%s:%zu: not a digest line\n", options.path, errorLine);
+        return 2;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    auto lastProgress = start;
+    size_t checked = 0;
+    uint64_t bytes = 0;
+    auto report = [&](const typename Manifest::Result& result) {
+        ++checked;
+        bytes += result.bytes;
+        if (result.status == Manifest::Status::Unreadable)
+            printf("%s: FAILED open or read\n", result.entry->path.c_str());
+        else if (result.status == Manifest::Status::Mismatch)
+            printf("%s: FAILED\n", result.entry->path.c_str());
+        else if (!options.quiet)
+            printf("%s: OK\n", result.entry->path.c_str());
+        const auto now = std::chrono::steady_clock::now();
+        if (now - lastProgress >= std::chrono::seconds(1)) {
+            lastProgress = now;
+            fflush(stdout);
+            fprintf(stderr, "%zu/%zu files, %.0f MB/s\n", checked, entries.size(), bytes / std::chrono::duration<double>(now - start).count() / 1e6);
+        }
+    };
+    const typename Manifest::Summary summary = Manifest::verify(entries, report, options.manifest);
+    fflush(stdout);
+    fprintf(stderr, "%zu files, %.1f MB in %.2f s (%.0f MB/s, %.0f files/s): %zu mismatched, %zu unreadable\n",
+        summary.files, summary.bytes / 1e6, summary.seconds, summary.bytes / summary.seconds / 1e6, summary.files / summary.seconds,
+        summary.mismatches, summary.unreadable);
+    return summary.mismatches || summary.unreadable ? 1 : 0;
+}
+
+int main(int argc, const char** argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        fprintf(stderr, "usage: %s [--threads=N] [--quiet] [--disable=sha,avx2,avx512] MANIFEST\n", argv[0]);
+        return 2;
+    }
+    std::string text;
+    if (!readFile(options.path, text)) {
+        fprintf(stderr, "%s: cannot read manifest\n", options.path);
+        return 2;
+    }
+
+    // Every line has the same digest length, so the first one picks the algorithm.
+    const size_t digestLength = std::min(text.find_first_of(" \r\n"), text.size());
+    switch (digestLength) {
+    case 2 * sizeof(SHA2::SHA224::Digest):
+        return verify<SHA2::SHA224>(options, text);
+    case 2 * sizeof(SHA2::SHA256::Digest):
+        return verify<SHA2::SHA256>(options, text);
+    case 2 * sizeof(SHA2::SHA314::Digest):
+        return verify<SHA2::SHA314>(options, text);
+    case 2 * sizeof(SHA2::SHA512::Digest):
+        return verify<SHA2::SHA512>(options, text);
+    default:
+        fprintf(stderr, "%s: digests of %zu hex digits are not SHA-2\n", options.path, digestLength);
+        return 2;
+    }
+}
@@ -0,0 +1,212 @@
+// The following license applies to all parts of this file.
+/*************************************************
+Copyright (c) 2017, Alex Christensen
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+*************************************************/
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace SHA2 {
+
+// A fixed set of worker threads with a task deque each. A worker runs the newest task of its own
+// deque first and, when that is empty, steals the oldest task of another worker, so tasks that
+// post more tasks keep their work local while idle workers take the largest remaining pieces.
+// Tasks posted from outside the pool are dealt to the deques in turn.
+// Only the deques are locked to pass tasks around; the counts of tasks are atomic, and the pool's
+// mutex is taken only by workers going to sleep and by the threads that wake them.
+// Destroying the pool finishes the tasks that are still queued.
+class ThreadPool {
+public:
+    // Zero threads means one per hardware thread.
+    explicit ThreadPool(size_t threads = 0)
+    {
+        if (!threads)
+            threads = defaultThreadCount();
+        for (size_t i = 0; i < threads; ++i)
+            queues.emplace_back(new Queue);
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back([this, i] { run(i); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        taskAvailable.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    static size_t defaultThreadCount()
+    {
+        const size_t threads = std::thread::hardware_concurrency();
+        return threads ? threads : 1;
+    }
+
+    void post(std::function<void()> task)
+    {
+        const CurrentWorker& current = currentWorker();
+        const size_t queue = current.pool == this ? current.index : nextQueue++ % queues.size();
+        unfinishedTasks.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+            queues[queue]->tasks.push_back(std::move(task));
+        }
+        queuedTasks.fetch_add(1);
+        // A worker counts itself as sleeping before it checks for tasks under the mutex, so either it sees
+        // this task or this sees it. Taking the mutex makes sure it is waiting before it is notified.
+        if (sleepingWorkers.load()) {
+            { std::lock_guard<std::mutex> lock(mutex); }
+            taskAvailable.notify_one();
+        }
+    }
+
+    // Waits until every posted task has finished. Tasks must not call this on their own pool.
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        allFinished.wait(lock, [this] { return !unfinishedTasks.load(); });
+    }
+
+    // Calls function(i) for each i below count, spread over the workers, and waits for all of them.
+    void parallelFor(size_t count, const std::function<void(size_t)>& function)
+    {
+        const size_t tasksToPost = std::min(count, 4 * size());
+        for (size_t task = 0; task < tasksToPost; ++task) {
+            const size_t begin = count * task / tasksToPost;
+            const size_t end = count * (task + 1) / tasksToPost;
+            post([&function, begin, end] {
+                for (size_t i = begin; i < end; ++i)
+                    function(i);
+            });
+        }
+        wait();
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    struct CurrentWorker {
+        ThreadPool* pool;
+        size_t index;
+    };
+
+    static CurrentWorker& currentWorker()
+    {
+        static thread_local CurrentWorker current { nullptr, 0 };
+        return current;
+    }
+
+    bool takeTask(size_t index, std::function<void()>& task)
+    {
+        for (size_t i = 0; i < queues.size(); ++i) {
+            Queue& queue = *queues[(index + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty())
+                continue;
+            if (!i) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Takes one of the queued tasks for this worker, or returns false if there are none.
+    bool claimTask()
+    {
+        size_t queued = queuedTasks.load();
+        while (queued) {
+            if (queuedTasks.compare_exchange_weak(queued, queued - 1))
+                return true;
+        }
+        return false;
+    }
+
+    void run(size_t index)
+    {
+        currentWorker() = { this, index };
+        while (true) {
+            if (!claimTask()) {
+                std::unique_lock<std::mutex> lock(mutex);
+                sleepingWorkers.fetch_add(1);
+                taskAvailable.wait(lock, [this] { return stopping || queuedTasks.load(); });
+                sleepingWorkers.fetch_sub(1);
+                if (stopping && !queuedTasks.load())
+                    return;
+                continue;
+            }
+            // Tasks are counted only once they are in a deque, so some deque holds a task for every count taken.
+            // It can be in the middle of being moved by its poster or another thief, so let them finish.
+            std::function<void()> task;
+            while (!takeTask(index, task))
+                std::this_thread::yield();
+            task();
+            if (unfinishedTasks.fetch_sub(1) == 1) {
+                { std::lock_guard<std::mutex> lock(mutex); }
+                allFinished.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<size_t> nextQueue { 0 };
+    std::atomic<size_t> queuedTasks { 0 };
+    std::atomic<size_t> unfinishedTasks { 0 };
+    std::atomic<size_t> sleepingWorkers { 0 };
+    // Only read and written with the mutex held.
+    bool stopping { false };
+    std::mutex mutex;
+    std::condition_variable taskAvailable;
+    std::condition_variable allFinished;
+};
+
+}
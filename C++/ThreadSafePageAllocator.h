@@ -0,0 +1,260 @@
+#ifndef UTILITIES_CPP_THREAD_SAFE_PAGE_ALLOCATOR_H
+#define UTILITIES_CPP_THREAD_SAFE_PAGE_ALLOCATOR_H
+
+// The following license applies to all parts of this file.
+/*************************************************
+The MIT License
+
+Copyright (c) 2012 Alex Christensen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*************************************************/
+
+//ThreadSafePageAllocator
+//
+//A PageAllocator that many threads can use at once.
+//Each thread keeps a magazine of up to MagazineSize free elements for each allocator it uses, and allocate and deallocate only touch that magazine.
+//The lock on the shared PageAllocator is taken only to refill an empty magazine or to give back half of a full one, MagazineSize/2 elements at a time.
+//An element can be deallocated by any thread; it goes into the magazine of the thread that deallocates it.
+//When a thread exits, the elements in its magazines go back to their allocators.
+//A thread only has magazines for MaxAllocatorsPerThread allocators of the same ElementSize and OverheadSize; its other allocations take the lock every time.
+//The allocator must not be destroyed while other threads still use it, but threads that have used it can outlive it.
+//This needs thread_local, so unlike PageAllocator.h it does not compile with Visual Studio 2013.
+
+#include "PageAllocator.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+template <size_t ElementSize, size_t OverheadSize=4>
+class ThreadSafePageAllocator
+{
+public:
+	ThreadSafePageAllocator();
+	~ThreadSafePageAllocator();
+	void* allocate();
+	void deallocate(void*);
+
+	//the pages of the shared PageAllocator and the elements allocated from them, which include the elements in magazines
+	size_t pageCount();
+	size_t allocatedCount();
+
+	enum { MagazineSize=64, MaxAllocatorsPerThread=4 };
+private:
+	struct Magazine
+	{
+		//0 if this magazine is unused. It is atomic because destroying an allocator clears it in other threads' caches
+		std::atomic<ThreadSafePageAllocator*> allocator;
+		size_t count;
+		void* elements[MagazineSize];//elements[count-1] is allocated next
+	};
+
+	//the magazines of one thread, which it gives back to their allocators when it exits
+	struct ThreadCache
+	{
+		Magazine magazines[MaxAllocatorsPerThread];
+		ThreadCache();
+		~ThreadCache();
+	};
+
+	//every ThreadCache, so that a destroyed allocator can forget its magazines in threads that are still running
+	struct Registry
+	{
+		std::mutex mutex;
+		std::vector<ThreadCache*> caches;
+	};
+
+	Magazine* findMagazine();
+	Magazine* claimMagazine();
+	void refill(Magazine*);
+	void giveBack(Magazine*, size_t count);
+
+	//trivially initialized thread_locals, so reading them does not need a guard
+	static ThreadCache*& currentThreadCache() { static thread_local ThreadCache* cache=0; return cache; }
+	static bool& threadCacheDestroyed() { static thread_local bool destroyed=false; return destroyed; }
+	static Registry& registry() { static Registry registry; return registry; }
+
+	std::mutex pagesMutex;//protects pages
+	PageAllocator<ElementSize,OverheadSize> pages;
+};
+
+template <size_t ElementSize, size_t OverheadSize>
+ThreadSafePageAllocator<ElementSize,OverheadSize>::ThreadCache::ThreadCache()
+{
+	for(size_t i=0;i<MaxAllocatorsPerThread;i++)
+	{
+		magazines[i].allocator.store(0,std::memory_order_relaxed);
+		magazines[i].count=0;
+	}
+	Registry& registry=ThreadSafePageAllocator::registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.caches.push_back(this);
+}
+
+template <size_t ElementSize, size_t OverheadSize>
+ThreadSafePageAllocator<ElementSize,OverheadSize>::ThreadCache::~ThreadCache()
+{
+	//other thread_local destructors that still allocate or deallocate after this take the lock instead
+	currentThreadCache()=0;
+	threadCacheDestroyed()=true;
+
+	Registry& registry=ThreadSafePageAllocator::registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.caches.erase(std::find(registry.caches.begin(),registry.caches.end(),this));
+	for(size_t i=0;i<MaxAllocatorsPerThread;i++)
+	{
+		ThreadSafePageAllocator* allocator=magazines[i].allocator.load(std::memory_order_relaxed);
+		if(allocator)
+			allocator->giveBack(magazines+i,magazines[i].count);
+	}
+}
+
+template <size_t ElementSize, size_t OverheadSize>
+ThreadSafePageAllocator<ElementSize,OverheadSize>::ThreadSafePageAllocator()
+{
+	//construct the registry before the first allocator so that it is destroyed after the last one, even when they are static
+	registry();
+}
+
+template <size_t ElementSize, size_t OverheadSize>
+ThreadSafePageAllocator<ElementSize,OverheadSize>::~ThreadSafePageAllocator()
+{
+	//the elements still in magazines are freed with the pages, so the magazines only need to forget them.
+	//only the allocator is cleared; the count belongs to the thread that owns the magazine and is reset when it is claimed again
+	Registry& registry=ThreadSafePageAllocator::registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	for(size_t i=0;i<registry.caches.size();i++)
+	{
+		for(size_t j=0;j<MaxAllocatorsPerThread;j++)
+		{
+			Magazine& magazine=registry.caches[i]->magazines[j];
+			if(magazine.allocator.load(std::memory_order_relaxed)==this)
+				magazine.allocator.store(0,std::memory_order_release);
+		}
+	}
+}
+
+template <size_t ElementSize, size_t OverheadSize>
+inline typename ThreadSafePageAllocator<ElementSize,OverheadSize>::Magazine* ThreadSafePageAllocator<ElementSize,OverheadSize>::findMagazine()
+{
+	ThreadCache* cache=currentThreadCache();
+	if(cache)
+	{
+		for(size_t i=0;i<MaxAllocatorsPerThread;i++)
+		{
+			if(cache->magazines[i].allocator.load(std::memory_order_acquire)==this)
+				return cache->magazines+i;
+		}
+	}
+	return claimMagazine();
+}
+
+template <size_t ElementSize, size_t OverheadSize>
+typename ThreadSafePageAllocator<ElementSize,OverheadSize>::Magazine* ThreadSafePageAllocator<ElementSize,OverheadSize>::claimMagazine()
+{
+	ThreadCache* cache=currentThreadCache();
+	if(!cache)
+	{
+		if(threadCacheDestroyed())
+			return 0;
+		static thread_local ThreadCache threadCache;
+		cache=currentThreadCache()=&threadCache;
+	}
+
+	//claim an unused magazine, under the registry lock because destroying an allocator reads every thread's magazines
+	Registry& registry=ThreadSafePageAllocator::registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	for(size_t i=0;i<MaxAllocatorsPerThread;i++)
+	{
+		if(!cache->magazines[i].allocator.load(std::memory_order_relaxed))
+		{
+			cache->magazines[i].allocator.store(this,std::memory_order_relaxed);
+			cache->magazines[i].count=0;
+			return cache->magazines+i;
+		}
+	}
+	return 0;
+}
+
+template <size_t ElementSize, size_t OverheadSize>
+void ThreadSafePageAllocator<ElementSize,OverheadSize>::refill(Magazine* magazine)
+{
+	//fill it halfway so that deallocations right after this do not have to give elements back
+	std::lock_guard<std::mutex> lock(pagesMutex);
+	for(size_t i=MagazineSize/2;i>0;i--)
+		magazine->elements[i-1]=pages.allocate();
+	magazine->count=MagazineSize/2;
+}
+
+template <size_t ElementSize, size_t OverheadSize>
+void ThreadSafePageAllocator<ElementSize,OverheadSize>::giveBack(Magazine* magazine, size_t count)
+{
+	//give back the elements that have been in the magazine the longest and keep the recently used ones
+	{
+		std::lock_guard<std::mutex> lock(pagesMutex);
+		for(size_t i=0;i<count;i++)
+			pages.deallocateLocked(magazine->elements[i]);
+	}
+	std::copy(magazine->elements+count,magazine->elements+magazine->count,magazine->elements);
+	magazine->count-=count;
+}
+
+template <size_t ElementSize, size_t OverheadSize>
+void* ThreadSafePageAllocator<ElementSize,OverheadSize>::allocate()
+{
+	Magazine* magazine=findMagazine();
+	if(!magazine)
+	{
+		std::lock_guard<std::mutex> lock(pagesMutex);
+		return pages.allocate();
+	}
+	if(magazine->count==0)
+		refill(magazine);
+	return magazine->elements[--magazine->count];
+}
+
+template <size_t ElementSize, size_t OverheadSize>
+void ThreadSafePageAllocator<ElementSize,OverheadSize>::deallocate(void* element)
+{
+	Magazine* magazine=findMagazine();
+	if(!magazine)
+	{
+		std::lock_guard<std::mutex> lock(pagesMutex);
+		pages.deallocateLocked(element);
+		return;
+	}
+	if(magazine->count==MagazineSize)
+		giveBack(magazine,MagazineSize/2);
+	magazine->elements[magazine->count++]=element;
+}
+
+template <size_t ElementSize, size_t OverheadSize>
+size_t ThreadSafePageAllocator<ElementSize,OverheadSize>::pageCount()
+{
+	std::lock_guard<std::mutex> lock(pagesMutex);
+	return pages.pageCount();
+}
+
+template <size_t ElementSize, size_t OverheadSize>
+size_t ThreadSafePageAllocator<ElementSize,OverheadSize>::allocatedCount()
+{
+	std::lock_guard<std::mutex> lock(pagesMutex);
+	return pages.allocatedCount();
+}
+
+#endif
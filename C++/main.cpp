@@ -1,4 +1,5 @@
 #include "AbstractSyntaxTree.h"
+#include "SHA256Generator.h"
 
 #ifndef _M_X64
 void __declspec(naked) assembly()
@@ -16,6 +17,9 @@ int main(int argc, char *argv[])
 {
 	assembly();
 	Compiler::Assembler::runAssemblerUnitTests();
+#ifdef _M_X64
+	Compiler::SHA256Generator::runSHA256GeneratorUnitTests();
+#endif
 	Compiler::AbstractSyntaxTree::runASTUnitTests();
 	return 0;
 }